@@ -75,12 +75,12 @@ class MyDynamicRepository : public DynamicRepository
       bool getPage(HttpRequest* request, HttpResponse *response)
       {
 	std::string json = "{ \"data\" : [";
-	std::set< std::string >* filenames = myUploadRepo->getFilenames();
-        std::set<std::string>::iterator it = filenames->begin(); 
-        while (it != filenames->end())
+	std::set< std::string > filenames = myUploadRepo->getFilenames();
+        std::set<std::string>::iterator it = filenames.begin(); 
+        while (it != filenames.end())
         {
           json += std::string("\"") + it->c_str() + '\"';
-          if (++it != filenames->end()) 
+          if (++it != filenames.end()) 
             json += ", ";
         }
         json += "] }";
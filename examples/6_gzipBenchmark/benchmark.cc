@@ -0,0 +1,207 @@
+//********************************************************
+/**
+ * @file  benchmark.cc
+ *
+ * @brief Compares nvj_gzip/nvj_gunzip (per-thread streams,
+ *        single allocation) with the previous implementation
+ *        (one deflateInit2 per call, 16KB realloc steps),
+ *        and with the block-parallel ParallelGzip::gzip.
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "libnavajo/nvjGzip.h"
+#include "libnavajo/ParallelGzip.hh"
+
+
+/***********************************************************************
+* The previous implementation, kept for reference
+***********************************************************************/
+
+size_t legacy_gzip( unsigned char** dst, const unsigned char* src, const size_t sizeSrc )
+{
+  z_stream strm;
+  size_t sizeDst=CHUNK;
+
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+
+  if ( deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 16+MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error(std::string("gzip : inflateInit2 error") );
+
+  if ( (*dst=(unsigned char *)malloc(CHUNK * sizeof (unsigned char))) == NULL )
+    throw std::runtime_error(std::string("gzip : malloc error (1)") );
+
+  strm.avail_in = sizeSrc;
+  strm.next_in = (Bytef*)src;
+
+  int i=0;
+  do
+  {
+    strm.avail_out = CHUNK;
+    strm.next_out = (Bytef*)*dst + i*CHUNK;
+    sizeDst=CHUNK * (i+1);
+    deflate(&strm, Z_FINISH );
+    i++;
+    if (strm.avail_out == 0)
+      *dst = (unsigned char*) realloc (*dst, CHUNK * (i+1) * sizeof (unsigned char) );
+  }
+  while (strm.avail_out == 0);
+
+  (void)deflateEnd(&strm);
+  return sizeDst - strm.avail_out;
+}
+
+size_t legacy_gunzip( unsigned char** dst, const unsigned char* src, const size_t sizeSrc )
+{
+  z_stream strm;
+  size_t sizeDst=CHUNK;
+
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = 0;
+  strm.next_in = Z_NULL;
+
+  if (inflateInit2(&strm, 16+MAX_WBITS) != Z_OK)
+    throw std::runtime_error(std::string("gunzip : inflateInit2 error") );
+
+  *dst=(unsigned char *)malloc(CHUNK * sizeof (unsigned char));
+  strm.avail_in = sizeSrc;
+  strm.next_in = (Bytef*)src;
+
+  int i=0;
+  do
+  {
+    strm.avail_out = CHUNK;
+    strm.next_out = (Bytef*)*dst + i*CHUNK;
+    sizeDst=CHUNK * (i+1);
+    inflate(&strm, Z_NO_FLUSH);
+    i++;
+    if (strm.avail_out == 0)
+      *dst = (unsigned char*) realloc (*dst, CHUNK * (i+1) * sizeof (unsigned char) );
+  }
+  while (strm.avail_out == 0);
+
+  (void)inflateEnd(&strm);
+  return sizeDst - strm.avail_out;
+}
+
+/***********************************************************************/
+
+double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/***********************************************************************/
+
+void fillJson(unsigned char *buf, size_t len)
+{
+  size_t pos=0;
+  unsigned n=0;
+  while (pos < len)
+  {
+    char entry[128];
+    int l=snprintf(entry, sizeof entry, "{\"id\":%u,\"name\":\"device-%u\",\"state\":\"%s\",\"value\":%u},",
+                   n, n % 977, (n % 3) ? "running" : "stopped", (n * 2654435761u) % 100000);
+    for (int i=0; i<l && pos<len; i++)
+      buf[pos++]=entry[i];
+    n++;
+  }
+}
+
+/***********************************************************************/
+
+int main()
+{
+  const size_t sizes[] = { 4*1024, 64*1024, 1024*1024, 8*1024*1024 };
+
+  printf("%10s %8s %14s %14s %14s %14s %14s\n", "size", "iter", "legacy gzip", "nvj_gzip", "parallel gzip", "legacy gunzip", "nvj_gunzip");
+
+  for (size_t s=0; s<sizeof(sizes)/sizeof(size_t); s++)
+  {
+    size_t len=sizes[s];
+    unsigned iterations = (unsigned)(64*1024*1024 / len);
+    if (iterations > 5000) iterations = 5000;
+
+    unsigned char *src=(unsigned char*)malloc(len);
+    fillJson(src, len);
+
+    unsigned char *zipped=NULL, *unzipped=NULL;
+    size_t zlen=0, ulen=0;
+
+    double t0=now();
+    for (unsigned i=0; i<iterations; i++)
+    {
+      zlen=legacy_gzip(&zipped, src, len);
+      free(zipped);
+    }
+    double tLegacyZip=(now()-t0)/iterations;
+
+    t0=now();
+    for (unsigned i=0; i<iterations; i++)
+    {
+      zlen=nvj_gzip(&zipped, src, len);
+      free(zipped);
+    }
+    double tZip=(now()-t0)/iterations;
+
+    t0=now();
+    for (unsigned i=0; i<iterations; i++)
+    {
+      zlen=ParallelGzip::gzip(&zipped, src, len, Z_BEST_SPEED, Z_DEFAULT_STRATEGY);
+      if (i < iterations-1) free(zipped);
+    }
+    double tParallelZip=(now()-t0)/iterations;
+
+    ulen=nvj_gunzip(&unzipped, zipped, zlen);
+    if (ulen != len || memcmp(unzipped, src, len))
+    {
+      fprintf(stderr, "ERROR: parallel gzip round trip failed for %lu bytes\n", (unsigned long)len);
+      return 1;
+    }
+    free(unzipped);
+    free(zipped);
+
+    zlen=nvj_gzip(&zipped, src, len);
+
+    t0=now();
+    for (unsigned i=0; i<iterations; i++)
+    {
+      ulen=legacy_gunzip(&unzipped, zipped, zlen);
+      free(unzipped);
+    }
+    double tLegacyUnzip=(now()-t0)/iterations;
+
+    t0=now();
+    for (unsigned i=0; i<iterations; i++)
+    {
+      ulen=nvj_gunzip(&unzipped, zipped, zlen);
+      if (i < iterations-1) free(unzipped);
+    }
+    double tUnzip=(now()-t0)/iterations;
+
+    if (ulen != len || memcmp(unzipped, src, len))
+    {
+      fprintf(stderr, "ERROR: round trip failed for %lu bytes\n", (unsigned long)len);
+      return 1;
+    }
+
+    printf("%10lu %8u %11.1f us %11.1f us %11.1f us %11.1f us %11.1f us\n", (unsigned long)len, iterations,
+           tLegacyZip*1e6, tZip*1e6, tParallelZip*1e6, tLegacyUnzip*1e6, tUnzip*1e6);
+
+    free(unzipped);
+    free(zipped);
+    free(src);
+  }
+
+  return 0;
+}
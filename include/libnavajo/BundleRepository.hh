@@ -0,0 +1,112 @@
+//********************************************************
+/**
+ * @file  BundleRepository.hh
+ *
+ * @brief Handles a web repository packed in a bundle file,
+ *        mapped in memory at runtime
+ *
+ * @version 1
+ */
+//********************************************************
+
+#ifndef BUNDLEREPOSITORY_HH_
+#define BUNDLEREPOSITORY_HH_
+
+#include <stdint.h>
+#include <string>
+#include <list>
+
+#include "libnavajo/WebRepository.hh"
+#include "libnavajo/nvjThread.h"
+
+#define BUNDLE_MAGIC "NVJBNDL1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 64
+
+/**
+* The bundle file format (generated by navajoPrecompiler -B), in the byte
+* order of the host: the header, the pages table and the displacements of
+* its minimal perfect hash (same hash as PrecompiledRepository), the strings
+* (nul terminated), then the contents, aligned on BUNDLE_ALIGN bytes.
+* All the offsets are relative to the beginning of the file, 0 meaning none.
+*/
+struct BundleHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nbPages;
+  uint64_t pagesOffset;          // BundlePage[nbPages]
+  uint64_t displacementsOffset;  // int32_t[nbPages]
+  uint64_t size;                 // the file size
+};
+
+struct BundlePage
+{
+  uint64_t urlOffset;
+  uint64_t urlLength;
+  uint64_t dataOffset;
+  uint64_t length;
+  uint64_t gzipOffset;           // precompressed variant
+  uint64_t gzipLength;
+  uint64_t mimeTypeOffset;       // none: from the url extension
+  uint64_t etagOffset;           // quoted strong entity tag
+  uint64_t fingerprintedUrlOffset;
+  uint64_t immutable;            // a fingerprinted alias
+};
+
+
+/**
+* BundleRepository - serves the pages of a bundle file, mapped in memory:
+* the processes serving the same bundle share it in the page cache.
+* A new bundle can be loaded while serving: the pages being sent keep the
+* previous mapping alive until they are freed.
+* A bundle must be replaced by a new file (rename), never rewritten in place.
+*/
+class BundleRepository : public WebRepository
+{
+    struct Bundle
+    {
+      void *map;
+      size_t size;
+      const BundleHeader *header;
+      const BundlePage *pages;
+      const int32_t *displacements;
+      volatile int refCount;
+    };
+
+    pthread_mutex_t _mutex;
+    Bundle *current;
+    std::list<Bundle *> retired; // replaced, still referenced
+    std::string location, path;
+
+    static Bundle* map(const std::string& path);
+    static void unmap(Bundle *bundle);
+    static const BundlePage* find(const Bundle *bundle, const char* url, size_t len);
+    static inline const char* string(const Bundle *bundle, uint64_t offset)
+      { return offset ? (const char*)bundle->map + offset : NULL; };
+
+    Bundle* acquire();
+    void release(Bundle *bundle);
+
+  public:
+    /**
+    * @param location: the url prefix of the pages
+    * @param path: the bundle file
+    */
+    BundleRepository(const std::string& location, const std::string& path);
+    virtual ~BundleRepository();
+
+    /**
+    * Map a new bundle, and serve it in place of the current one
+    * @param path: the bundle file (empty: the current file, replaced since)
+    * @return false if the bundle is invalid: the current one is kept
+    */
+    bool load(const std::string& path="");
+
+    virtual bool getFile(HttpRequest* request, HttpResponse *response);
+    virtual void freeFile(unsigned char *webpage);
+    virtual void getRoutes(std::vector<WebRoute>& routes) { routes.push_back(WebRoute(location, true)); };
+    virtual std::string getFingerprintedUrl(const std::string& url);
+};
+
+#endif
@@ -0,0 +1,106 @@
+//********************************************************
+/**
+ * @file  CompressedContentCache.hh
+ *
+ * @brief Bounded cache of compressed responses
+ *
+ * @version 1
+ */
+//********************************************************
+
+#ifndef COMPRESSEDCONTENTCACHE_HH_
+#define COMPRESSEDCONTENTCACHE_HH_
+
+#include <stdlib.h>
+#include <string>
+#include <map>
+#include <list>
+#include "libnavajo/nvjThread.h"
+#include "libnavajo/CompressionPolicy.hh"
+
+
+/**
+* CompressedContentCache - sharded LRU cache of the compressed variants of
+* the responses, keyed by repository, url, coding (with the compression
+* level and strategy) and content version.
+* Entries are reference counted: a cached buffer stays valid until it's released,
+* even if it has been evicted in the meantime.
+*/
+class CompressedContentCache
+{
+  public:
+
+    class Entry
+    {
+        friend class CompressedContentCache;
+        std::string key;
+        std::string version;
+        volatile int refCount;
+        std::list<Entry *>::iterator lruPos;
+        Entry(const std::string& k, const std::string& v, unsigned char* d, size_t l)
+          : key(k), version(v), refCount(1), data(d), length(l) {};
+        ~Entry() { ::free(data); };
+      public:
+        unsigned char* data;
+        size_t length;
+    };
+
+    CompressedContentCache(const size_t maxSize=16*1024*1024, const unsigned nbShards=8);
+    ~CompressedContentCache();
+
+    /**
+    * look for a compressed content
+    * @param repo: the repository which provides the content
+    * @param url: the url
+    * @param version: the content version token (mtime, ETag...)
+    * @param coding: the content coding (ex: "gzip")
+    * @param policy: the compression policy (its level and strategy)
+    * @return the entry (to release after use) or NULL if not found
+    */
+    Entry* get(const void* repo, const std::string& url, const std::string& version, const char* coding,
+               const CompressionPolicy& policy);
+
+    /**
+    * insert a compressed content
+    * @param data: the compressed content (allocated by malloc, the cache takes its ownership)
+    * @param length: the compressed content length
+    * @return the entry (to release after use)
+    */
+    Entry* put(const void* repo, const std::string& url, const std::string& version, const char* coding,
+               const CompressionPolicy& policy, unsigned char* data, const size_t length);
+
+    /**
+    * release an entry returned by get or put
+    */
+    static void release(Entry* entry);
+
+    void setMaxSize(const size_t maxSize);
+    inline size_t getMaxSize() const { return maxSize; };
+    size_t getSize();
+    size_t getNbEntries();
+    inline unsigned long getHits() const { return hits; };
+    inline unsigned long getMisses() const { return misses; };
+    void clear();
+
+  private:
+
+    struct Shard
+    {
+      pthread_mutex_t mutex;
+      std::map<std::string, Entry*> entries;
+      std::list<Entry*> lru; // most recently used first
+      size_t size;
+    };
+
+    Shard *shards;
+    unsigned nbShards;
+    size_t maxSize;
+    volatile unsigned long hits, misses;
+
+    static std::string getKey(const void* repo, const std::string& url, const char* coding, const CompressionPolicy& policy);
+    Shard& getShard(const std::string& key);
+    void removeEntry(Shard& shard, std::map<std::string, Entry*>::iterator it);
+    void evict(Shard& shard);
+};
+
+#endif
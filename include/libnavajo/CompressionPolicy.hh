@@ -0,0 +1,133 @@
+//****************************************************************************
+/**
+ * @file  CompressionPolicy.hh
+ *
+ * @brief When and how the responses are compressed
+ *
+ * @version 1
+ */
+//****************************************************************************
+
+#ifndef COMPRESSIONPOLICY_HH_
+#define COMPRESSIONPOLICY_HH_
+
+#include <string>
+#include <vector>
+#include <strings.h>
+#include "zlib.h"
+
+
+class CompressionPolicy
+{
+  size_t minSize;
+  size_t parallelMinSize;
+  int level;
+  int strategy;
+  std::vector<std::string> mimeTypes;
+
+  public:
+
+    /**
+    * Default policy: responses of 2KB or more, compressed with Z_BEST_SPEED,
+    * for text and well known compressible application types only.
+    * The gzip compression is parallelized from 1MB.
+    */
+    CompressionPolicy() : minSize(2048), parallelMinSize(1024*1024), level(Z_BEST_SPEED), strategy(Z_DEFAULT_STRATEGY)
+    {
+      const char *defaultMimeTypes[] = { "text/*", "application/javascript", "application/x-javascript",
+                                         "application/json", "application/xml", "application/xhtml+xml",
+                                         "application/rss+xml", "application/atom+xml", "application/postscript",
+                                         "application/x-tar", "application/wasm", "image/svg+xml",
+                                         "font/ttf", "font/otf", "application/vnd.ms-fontobject" };
+      for (size_t i=0; i<sizeof defaultMimeTypes / sizeof(char*); i++)
+        mimeTypes.push_back(defaultMimeTypes[i]);
+    };
+
+    /************************************************************************/
+    /**
+    * set the minimum size of the compressed content
+    * @param s: the size in bytes (Default value: 2048)
+    */
+    inline void setMinSize(const size_t s) { minSize=s; };
+    inline size_t getMinSize() const { return minSize; };
+
+    /************************************************************************/
+    /**
+    * set the minimum size of the contents compressed in parallel blocks (gzip only)
+    * @param s: the size in bytes, 0 to disable (Default value: 1MB)
+    */
+    inline void setParallelMinSize(const size_t s) { parallelMinSize=s; };
+    inline size_t getParallelMinSize() const { return parallelMinSize; };
+
+    /************************************************************************/
+    /**
+    * set the zlib compression level
+    * @param l: from Z_NO_COMPRESSION (compression disabled) to Z_BEST_COMPRESSION (Default value: Z_BEST_SPEED)
+    */
+    inline void setLevel(const int l) { level=l; };
+    inline int getLevel() const { return level; };
+
+    /************************************************************************/
+    /**
+    * set the zlib compression strategy
+    * @param s: Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED
+    */
+    inline void setStrategy(const int s) { strategy=s; };
+    inline int getStrategy() const { return strategy; };
+
+    /************************************************************************/
+    /**
+    * clear the list of compressible mime types
+    */
+    inline void clearMimeTypes() { mimeTypes.clear(); };
+
+    /************************************************************************/
+    /**
+    * add a compressible mime type
+    * @param mime: the mime type ("type/subtype", or "type/" followed by a star for all the subtypes)
+    */
+    inline void addMimeType(const std::string& mime) { mimeTypes.push_back(mime); };
+    inline const std::vector<std::string>& getMimeTypes() const { return mimeTypes; };
+
+    /************************************************************************/
+    /**
+    * is the mime type in the compressible list ?
+    * @param mime: the mime type (the parameters like "; charset=" are ignored)
+    */
+    inline bool isCompressible(const std::string& mime) const
+    {
+      size_t len=mime.find(';');
+      if (len == std::string::npos) len=mime.size();
+      while (len && mime[len-1] == ' ') len--;
+      if (!len) return false;
+
+      for (std::vector<std::string>::const_iterator it=mimeTypes.begin(); it!=mimeTypes.end(); it++)
+      {
+        size_t l=it->size();
+        if (l >= 2 && (*it)[l-1] == '*' && (*it)[l-2] == '/')
+        {
+          if (len > l-1 && strncasecmp(mime.c_str(), it->c_str(), l-1) == 0)
+            return true;
+        }
+        else
+          if (len == l && strncasecmp(mime.c_str(), it->c_str(), l) == 0)
+            return true;
+      }
+      return false;
+    };
+
+    /************************************************************************/
+    /**
+    * should the content be compressed ?
+    * @param mime: the content mime type
+    * @param length: the content length
+    */
+    inline bool shouldCompress(const std::string& mime, const size_t length) const
+    {
+      return level != Z_NO_COMPRESSION && length >= minSize && isCompressible(mime);
+    };
+};
+
+//****************************************************************************
+
+#endif
@@ -0,0 +1,102 @@
+//****************************************************************************
+/**
+ * @file  ContentCoding.hh
+ *
+ * @brief HTTP content codings (gzip, deflate, br, zstd) and
+ *        Accept-Encoding negotiation (rfc7231)
+ *
+ * @version 1
+ */
+//****************************************************************************
+
+#ifndef CONTENTCODING_HH_
+#define CONTENTCODING_HH_
+
+#include <string>
+#include <vector>
+#include "libnavajo/CompressionPolicy.hh"
+
+
+/**
+* AcceptEncoding - the codings accepted by the client, with their q-values
+*/
+class AcceptEncoding
+{
+  std::vector< std::pair<std::string, float> > codings;
+
+  public:
+    AcceptEncoding() {};
+
+    /**
+    * parse an Accept-Encoding header value
+    * @param value: the header value (ex: "gzip;q=0.8, br, *;q=0")
+    */
+    void parse(const char *value);
+    inline void clear() { codings.clear(); };
+
+    /**
+    * get the q-value of a coding
+    * @param name: the coding name
+    * @return the q-value, from 0 (not acceptable) to 1
+    */
+    float getQValue(const std::string& name) const;
+    inline bool isAccepted(const std::string& name) const { return getQValue(name) > 0; };
+
+    /**
+    * is the coding explicitly listed by the client ?
+    */
+    bool isListed(const std::string& name) const;
+};
+
+
+/**
+* ContentCoding - a content coding, and the registry of the available codings
+*/
+class ContentCoding
+{
+  std::string name;
+  static std::vector<ContentCoding *>& registry();
+
+  public:
+    ContentCoding(const std::string& n) : name(n) {};
+    virtual ~ContentCoding() {};
+
+    inline const std::string& getName() const { return name; };
+
+    /**
+    * encode a content
+    * @param dst: set to the encoded content (to free)
+    * @param src: the content
+    * @param sizeSrc: the content length
+    * @param policy: the compression policy (level, strategy)
+    * @return the encoded content length (throw a std::runtime_error if failed)
+    */
+    virtual size_t encode(unsigned char** dst, const unsigned char* src, const size_t sizeSrc, const CompressionPolicy& policy) const = 0;
+
+    /**
+    * add a coding to the registry, with a lower server preference than the
+    * previous ones, or replace the coding of the same name.
+    * (zstd and br if libnavajo has been built with them, then gzip and deflate
+    * are registered by default)
+    * @param coding: the coding
+    */
+    static void registerCoding(ContentCoding *coding);
+
+    /**
+    * get a registered coding
+    * @param name: the coding name
+    * @return the coding, or NULL
+    */
+    static const ContentCoding* get(const std::string& name);
+
+    /**
+    * choose the coding with the highest q-value (the server preference is used for ties)
+    * @param acceptEncoding: the codings accepted by the client
+    * @return the coding, or NULL for identity
+    */
+    static const ContentCoding* negotiate(const AcceptEncoding& acceptEncoding);
+};
+
+//****************************************************************************
+
+#endif
@@ -10,56 +10,93 @@
  * @date 19/02/15
  */
 //********************************************************
- 
+
 #ifndef DYNAMICREPOSITORY_HH_
 #define DYNAMICREPOSITORY_HH_
 
 #include <string>
-#include <map>
+#include <vector>
+#include <set>
 
 #include "libnavajo/WebRepository.hh"
 
+class DynamicPage;
+
 
+/**
+* DynamicRepository - routes the urls to the dynamic pages with a compressed
+* radix tree. The routes may contain parameters: ":name" matches a whole
+* segment (ex: "api/device/:id/state") and a last "*name" segment the end of
+* the url, their values are given by HttpRequest::getUrlParameter.
+* The static segments have priority over the parameters, then the wildcards.
+*
+* The tree is never modified: a new route copies the nodes of its path, and
+* the new root is published atomically. The lookups don't lock nor allocate.
+* Like the index of LocalRepository, the readers of the tree are counted by
+* parity of an epoch, and the replaced nodes are deleted once the readers of
+* both parities have left. The parameter names, given to the requests, are
+* kept with the repository.
+*/
 class DynamicRepository : public WebRepository
 {
+    struct RouteNode
+    {
+      std::string prefix;                // static characters
+      std::vector<RouteNode *> children; // static children (distinct first characters)
+      RouteNode *paramChild;             // ":name" segment
+      RouteNode *wildcardChild;          // "*name" end of url
+      const std::string *paramName;      // name of the parameter or wildcard ending at this node
+      DynamicPage *pages[DELETE_METHOD + 1]; // by method ([UNKNOWN_METHOD]: any method)
+    };
 
     pthread_mutex_t _mutex;
-    typedef std::map<std::string, DynamicPage *> IndexMap;
-    IndexMap indexMap;
-    
+    RouteNode *root;
+    volatile unsigned long treeReaders[2];
+    volatile unsigned treeEpoch;
+    std::set<std::string> paramNames;
+    std::vector<RouteNode *> createdNodes;        // by the route being added (under _mutex)
+    std::vector<const RouteNode *> replacedNodes; // by the route being added (under _mutex)
+
+    RouteNode* newNode(const RouteNode *node=NULL);
+    static void deleteTree(RouteNode *node);
+    RouteNode* insert(const RouteNode *node, const char *pattern, const char *p, HttpRequestMethod method, DynamicPage *page);
+    static inline DynamicPage* getPage(const RouteNode *node, HttpRequestMethod method)
+    {
+      DynamicPage *page=method <= DELETE_METHOD ? node->pages[method] : NULL;
+      return page != NULL ? page : node->pages[UNKNOWN_METHOD];
+    };
+    static DynamicPage* lookup(const RouteNode *node, const char *url, const char *path, HttpRequest* request);
+    static void getRoutes(const RouteNode *node, const std::string& url, std::vector<WebRoute>& routes);
+
   public:
-    DynamicRepository() { pthread_mutex_init(&_mutex, NULL); };
-    virtual ~DynamicRepository() { indexMap.clear(); };
-    
+    DynamicRepository();
+    virtual ~DynamicRepository();
+
     inline void freeFile(unsigned char *webpage) { ::free (webpage); };
 
-    inline void add(std::string url, DynamicPage *page)
-    { 
-      size_t i=0; 
-      while (url.size() && url[i]=='/') i++;
-      indexMap.insert(std::pair<std::string, DynamicPage *>(url.substr(i, url.size()-i), page)); };
+    /**
+    * add a route, for all the methods
+    * @param url: the url, with optional ":name" and "*name" segments
+    * @param page: the dynamic page
+    */
+    inline void add(std::string url, DynamicPage *page) { add(UNKNOWN_METHOD, url, page); };
 
-    inline virtual bool getFile(HttpRequest* request, HttpResponse *response)
-    {
-      std::string url = request->getUrl();
-      while (url.size() && url[0]=='/') url.erase(0, 1);
-      pthread_mutex_lock( &_mutex );
-      IndexMap::const_iterator i = indexMap.find (url);
-      if (i == indexMap.end())
-      {
-        pthread_mutex_unlock( &_mutex );
-        return false;
-      }
-      else
-      {
-        pthread_mutex_unlock( &_mutex );
-        bool res = i->second->getPage( request, response );
-        if (request->getSessionId().size())
-          response->addSessionCookie(request->getSessionId());
-        return res;
-      }
-    };
+    /**
+    * add a route, for a method
+    * @param method: the request method (UNKNOWN_METHOD: all the methods)
+    * @param url: the url, with optional ":name" and "*name" segments. A
+    * parameter must be named like the ones of the other routes at the same
+    * position, else the route is ignored (and an error is logged)
+    * @param page: the dynamic page
+    */
+    void add(HttpRequestMethod method, const std::string& url, DynamicPage *page);
+
+    virtual bool getFile(HttpRequest* request, HttpResponse *response);
 
+    /**
+    * report the routes without parameter, and the prefixes of the others
+    */
+    virtual void getRoutes(std::vector<WebRoute>& routes);
 };
 #endif
 
@@ -0,0 +1,36 @@
+//********************************************************
+/**
+ * @file  FileReader.hh
+ *
+ * @brief Reads the files served
+ *
+ * @version 1
+ */
+//********************************************************
+
+#ifndef FILEREADER_HH_
+#define FILEREADER_HH_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/**
+* FileReader - reads a file region into a buffer with pread, continuing the
+* short reads and the interrupted ones
+*/
+class FileReader
+{
+  public:
+    /**
+    * read a file region
+    * @param fd: the file descriptor
+    * @param buffer: the buffer, of at least length bytes
+    * @param length: the number of bytes to read
+    * @param offset: the position in the file
+    * @return the number of bytes read (less than length at the end of the file), or -1 on error
+    */
+    static ssize_t read(int fd, unsigned char *buffer, size_t length, off_t offset=0);
+};
+
+#endif
@@ -21,6 +21,7 @@
 #include <openssl/ssl.h>
 
 #include "libnavajo/IpAddress.hh"
+#include "libnavajo/ContentCoding.hh"
 #include "HttpSession.hh"
 
 #include "MPFDParser/Parser.h"
@@ -29,6 +30,7 @@
 
 typedef enum { UNKNOWN_METHOD = 0, GET_METHOD = 1, POST_METHOD = 2, PUT_METHOD = 3, DELETE_METHOD = 4 } HttpRequestMethod;
 typedef enum { GZIP, ZLIB, NONE } CompressionMode;
+#define URL_PARAMETERS_MAX 8
 typedef struct
 {
   int socketId;
@@ -54,6 +56,19 @@ class HttpRequest
   std::string sessionId;
   MPFD::Parser *mutipartContentParser;
   std::string jsonPayload ;
+  AcceptEncoding acceptEncoding;
+
+  // the parameters extracted from the url by the router (:name and *name segments):
+  // they point to the url and the route, without copy
+  struct UrlParameter
+  {
+    const char *name, *value;
+    size_t nameLength, valueLength;
+  };
+  UrlParameter urlParameters[URL_PARAMETERS_MAX];
+  unsigned nbUrlParameters;
+
+  friend class DynamicRepository;
 
   /**********************************************************************/
   /**
@@ -254,6 +269,37 @@ class HttpRequest
        res.push_back(iter->first);
       return res;
     }
+
+    /**********************************************************************/
+    /**
+    * get the value of a parameter of the route (ex: "id" for "device/:id/state")
+    * @param name: the parameter name
+    * @param value: the parameter value
+    * @return true is the parameter exist
+    */
+    inline bool getUrlParameter( const std::string& name, std::string &value ) const
+    {
+      for (unsigned i=0; i<nbUrlParameters; i++)
+        if (urlParameters[i].nameLength == name.size() && !name.compare(0, name.size(), urlParameters[i].name, urlParameters[i].nameLength))
+        {
+          value.assign(urlParameters[i].value, urlParameters[i].valueLength);
+          return true;
+        }
+      return false;
+    }
+
+    /**********************************************************************/
+    /**
+    * get the value of a parameter of the route
+    * @param name: the parameter name
+    * @return the parameter value
+    */
+    inline std::string getUrlParameter( const std::string& name ) const
+    {
+      std::string res="";
+      getUrlParameter(name, res);
+      return res;
+    }
     
     /**********************************************************************/
     /**
@@ -374,6 +420,7 @@ class HttpRequest
       this->clientSockData=client;
       this->mutipartContentParser=parser;
       this->jsonPayload=json ;
+      this->nbUrlParameters=0;
       
       if (params != NULL && strlen(params))
         decodParams(params);
@@ -473,6 +520,20 @@ class HttpRequest
       return clientSockData->compression;
     };
 
+    /**********************************************************************/
+    /**
+    * set the content codings accepted by the client
+    * @param value: the Accept-Encoding header value
+    */
+    inline void setAcceptEncoding(const char *value) { acceptEncoding.parse(value); };
+
+    /**********************************************************************/
+    /**
+    * get the content codings accepted by the client
+    * @return the codings with their q-values
+    */
+    inline const AcceptEncoding& getAcceptEncoding() const { return acceptEncoding; };
+
     /**********************************************************************/
     /**
     * get the http request client socket data 
@@ -14,20 +14,27 @@
 #ifndef HTTPRESPONSE_HH_
 #define HTTPRESPONSE_HH_
 
+class CompressionPolicy;
 
 class HttpResponse
 {
   unsigned char *responseContent;
   size_t responseContentLength;
+  int responseFd;
   std::vector<std::string> responseCookies;
   bool zippedFile;
   std::string mimeType;
   std::string forwardToUrl;
   bool cors, corsCred;
   std::string corsDomain;
+  std::string contentVersion;
+  std::string etag;
+  std::string cacheControl;
+  bool varyAcceptEncoding;
+  const CompressionPolicy *compressionPolicy;
   
   public:
-    HttpResponse(std::string mime="") : responseContent (NULL), responseContentLength (0), zippedFile (false), mimeType(mime), forwardToUrl(""), cors(false), corsCred(false), corsDomain("")
+    HttpResponse(std::string mime="") : responseContent (NULL), responseContentLength (0), responseFd (-1), zippedFile (false), mimeType(mime), forwardToUrl(""), cors(false), corsCred(false), corsDomain(""), contentVersion(""), etag(""), cacheControl(""), varyAcceptEncoding(false), compressionPolicy(NULL)
     {
     }
     
@@ -42,6 +49,27 @@ class HttpResponse
       responseContent = content;
       responseContentLength = length;
     }
+
+    /************************************************************************/
+    /**
+    * set the response body from an open file, sent without copy (sendfile)
+    * when it's not compressed. The repository releases it with freeFileContent.
+    * @param fd: The file descriptor, read from the beginning
+    * @param length: The content's length
+    */
+    inline void setFileContent(int fd, size_t length)
+    {
+      responseContent = NULL;
+      responseFd = fd;
+      responseContentLength = length;
+    }
+
+    /************************************************************************/
+    /**
+    * get the file descriptor of the response body
+    * @return the descriptor given with setFileContent, or -1
+    */
+    inline int getFileContent() const { return responseFd; };
     
     /************************************************************************/
     /**
@@ -71,6 +99,67 @@ class HttpResponse
     */
     inline bool isZipped() const { return zippedFile; }; 
 
+    /************************************************************************/
+    /**
+    * Set a version token (mtime, ETag...) identifying the content.
+    * The compressed variants of a versioned content are cached by the webserver.
+    * @param version: the version token, empty if the content can't be cached
+    */
+    inline void setContentVersion(const std::string& version) { contentVersion=version; };
+
+    /************************************************************************/
+    /**
+    * get the content version token
+    * @return the version token (empty if the content can't be cached)
+    */
+    inline const std::string& getContentVersion() const { return contentVersion; };
+
+    /************************************************************************/
+    /**
+    * Set a strong entity tag (rfc7232) for the content: the webserver answers
+    * "304 Not Modified" to the requests with a matching If-None-Match header.
+    * @param tag: the quoted entity tag (ex: "\"5d41402abc4b2a76\""), empty for none
+    */
+    inline void setETag(const std::string& tag) { etag=tag; };
+
+    /************************************************************************/
+    /**
+    * get the entity tag
+    * @return the quoted entity tag, empty if none
+    */
+    inline const std::string& getETag() const { return etag; };
+
+    /************************************************************************/
+    /**
+    * Set the Cache-Control header of the response
+    * @param value: the header value (ex: "public, max-age=31536000, immutable"), empty for none
+    */
+    inline void setCacheControl(const std::string& value) { cacheControl=value; };
+    inline const std::string& getCacheControl() const { return cacheControl; };
+
+    /************************************************************************/
+    /**
+    * Set if the repository has chosen the content from the Accept-Encoding header
+    * (the response is sent with "Vary: Accept-Encoding")
+    * @param b: true if the content depends on Accept-Encoding
+    */
+    inline void setVaryAcceptEncoding(bool b=true) { varyAcceptEncoding=b; };
+    inline bool isVaryAcceptEncoding() const { return varyAcceptEncoding; };
+
+    /************************************************************************/
+    /**
+    * Override the compression policy for this response only
+    * @param policy: the policy (NULL: the repository's or the webserver's policy is used)
+    */
+    inline void setCompressionPolicy(const CompressionPolicy *policy) { compressionPolicy=policy; };
+
+    /************************************************************************/
+    /**
+    * get the compression policy of this response
+    * @return the policy, or NULL if not overridden
+    */
+    inline const CompressionPolicy* getCompressionPolicy() const { return compressionPolicy; };
+
     /************************************************************************/
     /**
     * insert a cookie entry (rfc6265) 
@@ -1,12 +1,12 @@
 //****************************************************************************
 /**
- * @file  HttpSession.hh 
+ * @file  HttpSession.hh
  *
  * @brief The Http Sessions Manager class
  *
  * @author T.Descombes (descombes@lpsc.in2p3.fr)
  *
- * @version 1	
+ * @version 1
  * @date 27/01/15
  */
 //****************************************************************************
@@ -20,6 +20,12 @@
 #include <sstream>
 
 #include <stdlib.h>
+#include <time.h>
+
+#include "libnavajo/nvjThread.h"
+
+#define HTTPSESSION_SHARDS 64
+#define HTTPSESSION_EXPIRATION_BATCH 1024
 
 class SessionAttributeObject
 {
@@ -27,6 +33,15 @@ class SessionAttributeObject
     virtual ~SessionAttributeObject() {};
 };
 
+/**
+* HttpSession - the sessions, in shards selected by a hash of their id.
+* Each shard is protected by a reader/writer lock: the lookups of the
+* requests only take the read lock, and update the expiration time
+* atomically.
+* The expirations of a shard are scheduled in a min-heap, processed every
+* second by a background thread. An entry isn't moved when its session is
+* used: it's pushed again with the new expiration time when it's reached.
+*/
 class HttpSession
 {
   typedef struct {
@@ -38,282 +53,112 @@ class HttpSession
     };
   } SessionAttribute;
 
-
-  typedef std::map <std::string, std::map <std::string, SessionAttribute>* > HttpSessionsContainerMap;
-
-  static HttpSessionsContainerMap sessions;
-  static pthread_mutex_t sessions_mutex; 
-  static time_t lastExpirationSearchTime;
+  typedef std::map <std::string, SessionAttribute> SessionAttributes;
+
+  struct Session
+  {
+    SessionAttributes attributes; // modified under the write lock of the shard
+    volatile time_t expiration;   // 0: never expires
+    bool scheduled;               // has an entry in the expiration heap (under the write lock)
+  };
+
+  struct Expiration
+  {
+    time_t time;
+    Session *session;
+    std::string id;
+    Expiration(time_t t, Session *s, const std::string& i) : time(t), session(s), id(i) {};
+    inline bool operator<(const Expiration& e) const { return time > e.time; }; // earliest on top
+  };
+
+  typedef std::map <std::string, Session* > HttpSessionsContainerMap;
+
+  struct Shard
+  {
+    pthread_rwlock_t lock;
+    HttpSessionsContainerMap sessions;
+    std::vector<Expiration> expirations; // heap
+    Shard() { pthread_rwlock_init(&lock, NULL); };
+  };
+
+  static Shard *shards; // never freed: the expiration thread runs until the exit
   static time_t sessionLifeTime;
-  
+  static size_t sessionIdLength;
+  static pthread_once_t expirationThreadOnce;
+
+  static inline Shard& getShard(const std::string& id)
+  {
+    // FNV-1a
+    unsigned h=2166136261u;
+    for (size_t i=0; i<id.size(); i++)
+      h = (h ^ (unsigned char)id[i]) * 16777619u;
+    return shards[h % HTTPSESSION_SHARDS];
+  };
+
+  static void removeAllAttribute(SessionAttributes& attributes);
+  static void freeAttribute(SessionAttribute& attribute);
+  static void setSessionAttribute(const std::string &sid, const std::string &name, const SessionAttribute& attribute);
+  static bool getSessionAttribute(const std::string &sid, const std::string &name, SessionAttribute& attribute);
+  static void generateId(std::string& id);
+  static void schedule(Shard& shard, const std::string& id, Session *session);
+  static void reschedule(Shard& shard, const std::string& id);
+  static bool removeExpiredSession(Shard& shard, time_t now);
+  static void startExpirationThread();
+  static void* expirationThread(void *);
+
   public:
 
     inline static void setSessionLifeTime(const time_t sec) { sessionLifeTime = sec; };
 
     inline static time_t getSessionLifeTime() { return sessionLifeTime; };
 
-    /**********************************************************************/
-
-    static void create(std::string& id)
-    {
-
-      const size_t idLength=128;
-      const char elements[] = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-      const size_t nbElements = sizeof(elements) / sizeof(char);
-      srand(time(NULL));
-
-      id.reserve(idLength);
-
-      do
-      {
-        id.clear();
-        for(size_t i = 0; i < idLength; ++i) 
-          id+=elements[rand()%(nbElements - 1)];
-      }
-      while (find(id));
-
-      pthread_mutex_lock( &sessions_mutex );
-      sessions[id]=new std::map <std::string, SessionAttribute>();
-      pthread_mutex_unlock( &sessions_mutex );
-      time_t *expiration=(time_t *)malloc(sizeof(time_t));
-      *expiration=time(NULL)+sessionLifeTime;
-      setAttribute(id, "session_expiration", expiration);
-      
-      // look for expired session (max every minute)
-      if (time(NULL) > lastExpirationSearchTime + 60)
-      {
-        removeExpiredSession();
-        lastExpirationSearchTime = time(NULL);
-      }
-    };
-    
-    /**********************************************************************/
-
-    static void updateExpiration(const std::string& id)
-    {
-      time_t *expiration=(time_t*)getAttribute(id, "session_expiration");
-      if (expiration != NULL)
-        *expiration=time(NULL)+sessionLifeTime;
-    };
-
-    /**********************************************************************/
-
-    static void noExpiration(const std::string& id)
-    {
-      time_t *expiration=(time_t*)getAttribute(id, "session_expiration");
-      if (expiration != NULL)
-        *expiration=0;
-    };
-
-    /**********************************************************************/
-
-    static void removeExpiredSession()
-    {
-
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.begin();
-      for (;it != sessions.end(); )
-      {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        std::map <std::string, SessionAttribute>::iterator it2 = attributesMap->find("session_expiration");
-        time_t *expiration=NULL;
-        if (it2 != attributesMap->end()) expiration=(time_t*) it2->second.ptr;
-
-        if (expiration!=NULL && *expiration && *expiration > time(NULL))
-        {
-          it++;
-          continue;
-        }
-
-        removeAllAttribute(attributesMap);
-        delete attributesMap;
-        sessions.erase(it++);
-      }
-      pthread_mutex_unlock( &sessions_mutex );
-    }
-
-    /**********************************************************************/
-
-    static void removeAllSession()
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.begin();
-      for (;it != sessions.end(); )
-      {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        removeAllAttribute(attributesMap);
-        delete attributesMap;
-        sessions.erase(it++);
-      }    
-    }
-    
-    static bool find(const std::string& id)
-    {
-
-      bool res;
-      pthread_mutex_lock( &sessions_mutex );
-      res=sessions.size() && sessions.find(id) != sessions.end() ;
-      pthread_mutex_unlock( &sessions_mutex );
-      if (res)
-        updateExpiration(id);
-
-      return res;
-    }
-    
-    /**********************************************************************/
-    
-    static void remove(const std::string& sid)
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; };
-      removeAllAttribute(it->second);
-      delete it->second;
-      sessions.erase(it);
-      pthread_mutex_unlock( &sessions_mutex );
-    }
-
-    /**********************************************************************/
-
-    static void setObjectAttribute ( const std::string &sid, const std::string &name, SessionAttributeObject *sessionAttributeObject )
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::const_iterator it = sessions.find(sid);
-
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; };
-
-      SessionAttribute attribute;
-      attribute.type=SessionAttribute::OBJECT;
-      attribute.obj=sessionAttributeObject;
-      it->second->insert(std::pair<std::string, SessionAttribute>(name, attribute ));
-      pthread_mutex_unlock( &sessions_mutex );
-    }
-
-    /**********************************************************************/
-
-    static void setAttribute ( const std::string &sid, const std::string &name, void* value )
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::const_iterator it = sessions.find(sid);
-
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; };
-
-      SessionAttribute attribute;
-      attribute.type=SessionAttribute::BASIC;
-      attribute.ptr=value;
-      it->second->insert(std::pair<std::string, SessionAttribute>(name, attribute ));
-      pthread_mutex_unlock( &sessions_mutex );
-    }
-
-    /**********************************************************************/
-
-    static SessionAttributeObject *getObjectAttribute( const std::string &sid, const std::string &name )
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return NULL; }
-
-      std::map <std::string, SessionAttribute>* sessionMap=it->second;
-      std::map <std::string, SessionAttribute>::iterator it2 = sessionMap->find(name);
-      pthread_mutex_unlock( &sessions_mutex );
-
-      if ( it2 != sessionMap->end() && (it2->second.type == SessionAttribute::OBJECT) )
-        return it2->second.obj;
-      return NULL;
-    }
-
-    /**********************************************************************/
-
-    static void *getAttribute( const std::string &sid, const std::string &name )
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return NULL; }
-
-      std::map <std::string, SessionAttribute>* sessionMap=it->second;
-      std::map <std::string, SessionAttribute>::iterator it2 = sessionMap->find(name);
-      pthread_mutex_unlock( &sessions_mutex );
-
-      if ( it2 != sessionMap->end() && (it2->second.type == SessionAttribute::BASIC))
-        return it2->second.ptr;
-      return NULL;
-    }
-
-    /**********************************************************************/
-    
-    static void removeAllAttribute( std::map <std::string, SessionAttribute>* attributesMap)
-    {
-      std::map <std::string, SessionAttribute>::iterator iter = attributesMap->begin();
-      for(; iter!=attributesMap->end(); ++iter)
-        if (iter->second.ptr != NULL)
-        {
-          if (iter->second.type==SessionAttribute::OBJECT)
-            delete iter->second.obj;
-          else
-            free (iter->second.ptr);
-        }
-    }
-
-    /**********************************************************************/
-    
-    static void removeAttribute( const std::string &sid, const std::string &name )
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; }
-      std::map <std::string, SessionAttribute>* attributesMap=it->second;
-      std::map <std::string, SessionAttribute>::iterator it2 = attributesMap->find(name);
-      if ( it2 != attributesMap->end() ) 
-      { 
-        if (it2->second.ptr != NULL)
-        {
-          if (it2->second.type==SessionAttribute::OBJECT)
-            delete it2->second.obj;
-          else
-            free (it2->second.ptr);
-        }
-        attributesMap->erase(it2);
-      }
-      pthread_mutex_unlock( &sessions_mutex ); 
-    }
-
-    /**********************************************************************/
-    
-    static std::vector<std::string> getAttributeNames( const std::string &sid )
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      std::vector<std::string> res;
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it != sessions.end()) 
-      {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        std::map <std::string, SessionAttribute>::iterator iter = attributesMap->begin();
-        for(; iter!=attributesMap->end(); ++iter)
-          res.push_back(iter->first);
-      }
-      pthread_mutex_unlock( &sessions_mutex );
-      return res;
-    }
-    
-    /**********************************************************************/
-    
-    static void printAll()
-    {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.begin();
-      for (;it != sessions.end(); ++it )
-      {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        printf("Session SID : '%s' \n", it->first.c_str());
-        std::map <std::string, SessionAttribute>::iterator iter = attributesMap->begin();
-        for(; iter!=attributesMap->end(); ++iter)
-          if ( iter->second.ptr != NULL ) printf("\t'%s'\n", iter->first.c_str());
-      }
-            pthread_mutex_unlock( &sessions_mutex );    
-    }
-    
-    /**********************************************************************/    
-
+    /**
+    * set the length of the new session ids, made of [a-zA-Z0-9] characters
+    * drawn from the kernel CSPRNG (about 5.95 bits of entropy each)
+    * @param length: the number of characters, at least 16 (Default value: 128)
+    */
+    inline static void setSessionIdLength(const size_t length) { sessionIdLength = length < 16 ? 16 : length; };
+
+    inline static size_t getSessionIdLength() { return sessionIdLength; };
+
+    /**
+    * create a new session
+    * @param id: set to the session id
+    */
+    static void create(std::string& id);
+
+    /**
+    * postpone the expiration of a session
+    */
+    static void updateExpiration(const std::string& id);
+
+    /**
+    * the session will never expire
+    */
+    static void noExpiration(const std::string& id);
+
+    /**
+    * remove the expired sessions (done every second by a background thread)
+    */
+    static void removeExpiredSession();
+    static void removeAllSession();
+
+    /**
+    * check if a session exists and has not expired, and postpone its
+    * expiration
+    * @param id: the session id
+    * @return true if the session is valid
+    */
+    static bool find(const std::string& id);
+
+    static void remove(const std::string& sid);
+    static void setObjectAttribute ( const std::string &sid, const std::string &name, SessionAttributeObject *sessionAttributeObject );
+    static void setAttribute ( const std::string &sid, const std::string &name, void* value );
+    static SessionAttributeObject *getObjectAttribute( const std::string &sid, const std::string &name );
+    static void *getAttribute( const std::string &sid, const std::string &name );
+    static void removeAttribute( const std::string &sid, const std::string &name );
+    static std::vector<std::string> getAttributeNames( const std::string &sid );
+    static void printAll();
 };
 
 //****************************************************************************
@@ -16,8 +16,13 @@
 
 #include "WebRepository.hh"
 
+#include <stdint.h>
 #include <set>
+#include <map>
+#include <list>
+#include <vector>
 #include <string>
+#include <sys/stat.h>
 #include "libnavajo/nvjThread.h"
 
 
@@ -25,26 +30,176 @@ class LocalRepository : public WebRepository
 {
     pthread_mutex_t _mutex;
 
-    std::set< std::string > filenamesSet; // list of available files
+    // the index read by the requests: an immutable hash table, replaced by
+    // a new one at each change (RCU). The readers don't lock: they are
+    // counted by parity of the epoch, and an index is deleted once the
+    // readers of both parities have left it.
+    struct FileIndex
+    {
+      std::vector< std::string > urls;
+      std::vector< const char* > mimeTypes;
+      std::vector< uint32_t > slots; // url number + 1 (0: free slot), a power of 2
+      FileIndex(const std::map< std::string, const char* >& files);
+      bool find(const std::string& url, const char **mimeType) const;
+    };
+
+    FileIndex *index;
+    volatile unsigned long indexReaders[2];
+    volatile unsigned indexEpoch;
+    bool indexChanged;
+
+    std::map< std::string, const char* > filenames; // available files | mime type (the index source, under _mutex)
     //pair<std::string,std::string> aliasesSet; // alias name | Path to local directory
     std::string aliasName;
     std::string fullPathToLocalDir;
 
-    bool loadFilename_dir(const std::string& alias, const std::string& path, const std::string& subpath="");
-    bool fileExist(const std::string& url);
+    bool fingerprinting;
+    bool precompressed;
+    std::map< std::string, std::pair<std::string, std::string> > fingerprints; // url | version, fingerprint
+
+    // the contents are allocated after a reference counted header, shared
+    // by the cache and the responses
+    struct FileBuffer
+    {
+      volatile int refCount;
+      size_t length;
+    };
+
+    struct CachedFile
+    {
+      FileBuffer *buffer;
+      std::string version;
+      std::list<std::string>::iterator lruPos;
+    };
+
+    pthread_mutex_t cacheMutex;
+    std::map< std::string, CachedFile > cache;
+    std::list< std::string > cacheLru; // most recently used first
+    size_t cacheMaxSize, cacheSize;
+    volatile unsigned long cacheHits, cacheMisses;
+
+    static inline FileBuffer* getBuffer(unsigned char *webpage) { return (FileBuffer *)webpage - 1; };
+    static inline unsigned char* getData(FileBuffer *buffer) { return (unsigned char *)(buffer + 1); };
+    static void release(FileBuffer *buffer);
+    void removeCachedFile(std::map< std::string, CachedFile >::iterator it);
+    void evict();
+    unsigned char* getCachedContent(const std::string& url, const std::string& version, size_t *length);
+    void cacheContent(const std::string& url, const std::string& version, unsigned char *webpage, size_t length);
+
+    // the open files, with their status: shared by the cache of descriptors
+    // and the responses sent from them (reference counted under fdCacheMutex)
+    struct OpenFile
+    {
+      int fd;
+      struct stat status;
+      time_t checked;    // last time the status was checked
+      int refCount;
+      bool cached;
+      std::list<std::string>::iterator lruPos;
+    };
+
+    pthread_mutex_t fdCacheMutex;
+    std::map< std::string, OpenFile* > fdCache;
+    std::list< std::string > fdCacheLru; // most recently used first
+    std::map< int, OpenFile* > openFiles; // all the open files, by descriptor
+    size_t fdCacheMaxSize;
+    time_t fdCacheValidity;
+
+    OpenFile* openFile(const std::string& url);
+    bool getStatus(const std::string& url, struct stat& s, OpenFile **file);
+    void closeFile(OpenFile *file);
+    void removeOpenFile(std::map< std::string, OpenFile* >::iterator it);
+    void evictOpenFiles();
+
+    // the inotify watcher (Linux)
+    pthread_t watchThread;
+    volatile bool watching;
+    int watchFd, watchPipe[2];
+    std::map< int, std::string > watchedDirs; // watch descriptor | subpath
+
+    static void* startWatchThread(void *);
+    void watch();
+    void addWatches(const std::string& subpath);
+    void removeWatches(const std::string& subpath);
+    void applyEvent(int wd, uint32_t mask, const char *name);
+    void addFiles(const std::string& subpath);
+    void removeFiles(const std::string& url);
+    void invalidate(const std::string& url);
+    std::string getUrl(const std::string& subpath);
+
+    bool loadFilename_dir(std::map< std::string, const char* >& files, const std::string& alias, const std::string& path, const std::string& subpath="");
+    bool fileExist(const std::string& url, const char **mimeType=NULL);
+    void publishIndex();
+    std::string getFilePath(const std::string& url);
+    unsigned char* readFile(OpenFile *file);
+    unsigned char* readFile(const std::string& url, size_t *length, std::string& version);
+    std::string getFingerprint(const std::string& url, const std::string& version, const unsigned char* content, size_t length);
 
     
   public:
     LocalRepository (const std::string& alias, const std::string& dirPath);
-    virtual ~LocalRepository () { };
+    virtual ~LocalRepository ();
 
     virtual bool getFile(HttpRequest* request, HttpResponse *response);
-    virtual void freeFile(unsigned char *webpage) { ::free(webpage); };
+    virtual void freeFile(unsigned char *webpage) { release(getBuffer(webpage)); };
+    virtual void freeFileContent(int fd);
+    virtual void getRoutes(std::vector<WebRoute>& routes) { routes.push_back(WebRoute(aliasName, true)); };
     //void addDirectory(const std::string& alias, const std::string& dirPath);
     //void clearAliases();
     void reload();
-    inline std::set< std::string >* getFilenames() { return &filenamesSet; }
+
+    /**
+    * Watch the directory with inotify (Linux only): the added, removed and
+    * renamed files are applied to the index at once, and the contents of the
+    * modified files are removed from the cache.
+    * @param b: enabled or not (Default value: false)
+    * @return false if the directory can't be watched
+    */
+    bool setWatching(bool b=true);
+    std::set< std::string > getFilenames();
     void printFilenames();
+
+    /**
+    * Serve the files under fingerprinted aliases too (ex: js/app.3f9a1c07.js),
+    * with an immutable Cache-Control. The fingerprint is a hash of the content,
+    * computed at the first use and after each modification of the file.
+    * @param b: enabled or not (Default value: false)
+    */
+    inline void setFingerprinting(bool b=true) { fingerprinting=b; };
+
+    /**
+    * Send the gzip sidecar of a file (ex: js/app.js.gz for js/app.js) to the
+    * clients accepting gzip, when it's not older than the file: the content
+    * is compressed once, by the build.
+    * @param b: enabled or not (Default value: true)
+    */
+    inline void setPrecompressedFiles(bool b=true) { precompressed=b; };
+
+    /**
+    * Keep the contents of the most recently used files in memory. A cached
+    * content is served while the modification time and size of its file
+    * don't change. The files bigger than a quarter of the size aren't cached.
+    * @param size: the maximum size in bytes, 0 to disable the cache (Default value: 0)
+    */
+    void setCacheSize(const size_t size);
+    inline size_t getCacheMaxSize() const { return cacheMaxSize; };
+    size_t getCacheSize();
+    inline unsigned long getCacheHits() const { return cacheHits; };
+    inline unsigned long getCacheMisses() const { return cacheMisses; };
+    void clearCache();
+
+    /**
+    * Keep the most recently used files open, with their status: the requests
+    * don't open nor stat them. A cached descriptor is checked again with stat
+    * after the validity delay, or at once by the watcher (see setWatching).
+    * The process must be allowed to open as many more files (RLIMIT_NOFILE).
+    * @param nbFiles: the maximum number of open files, 0 to disable (Default value: 0)
+    * @param validity: the delay in seconds before checking a file again (Default value: 1)
+    */
+    void setOpenFileCacheSize(const size_t nbFiles, const time_t validity=1);
+    inline size_t getOpenFileCacheMaxSize() const { return fdCacheMaxSize; };
+    void clearOpenFileCache();
+    virtual std::string getFingerprintedUrl(const std::string& url);
 };
 
 #endif
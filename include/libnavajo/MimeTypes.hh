@@ -0,0 +1,78 @@
+//********************************************************
+/**
+ * @file  MimeTypes.hh
+ *
+ * @brief Registry of the mime types, by file extension
+ *
+ * @version 1
+ */
+//********************************************************
+
+#ifndef MIMETYPES_HH_
+#define MIMETYPES_HH_
+
+#include <string>
+
+
+/**
+* MimeTypes - maps the file extensions (case insensitive) to the mime types,
+* in an open addressing hash table. The table is never modified: an added
+* type is published in a new copy, so the lookups don't lock.
+* The returned strings remain valid until the end of the process.
+*/
+class MimeTypes
+{
+    struct Entry
+    {
+      const char *extension; // lower case, without '.' (NULL: free slot)
+      size_t length;
+      const char *mimeType;
+    };
+
+    struct Table
+    {
+      Entry *entries;
+      size_t size;           // power of 2
+      size_t nbEntries;
+    };
+
+    static Table *table;
+
+    static void init();
+    static Table* getTable();
+    static inline unsigned hash(const char *ext, size_t len)
+    {
+      // FNV-1a on the lower case characters
+      unsigned h=2166136261u;
+      for (size_t i=0; i<len; i++)
+        h = (h ^ (unsigned char)(ext[i] >= 'A' && ext[i] <= 'Z' ? ext[i] + 'a' - 'A' : ext[i])) * 16777619u;
+      return h;
+    };
+    static void insert(Table *t, const char *extension, size_t length, const char *mimeType);
+    static void put(const std::string& extension, const std::string& mimeType);
+
+  public:
+    /**
+    * get the mime type of a file
+    * @param filename: the file name or url
+    * @return the mime type, or NULL if the extension is unknown
+    */
+    static const char* get(const char *filename);
+
+    /**
+    * get the mime type of an extension
+    * @param extension: the extension (without '.')
+    * @param length: the extension length
+    * @return the mime type, or NULL if unknown
+    */
+    static const char* getByExtension(const char *extension, size_t length);
+
+    /**
+    * add or replace the mime type of an extension (ex: add("woff2", "font/woff2"))
+    * @param extension: the extension, with or without '.'
+    * @param mimeType: the mime type
+    */
+    static void add(const std::string& extension, const std::string& mimeType);
+};
+
+#endif
@@ -0,0 +1,63 @@
+//****************************************************************************
+/**
+ * @file  ParallelGzip.hh
+ *
+ * @brief Block-parallel gzip compression of large contents
+ *
+ * @version 1
+ */
+//****************************************************************************
+
+#ifndef PARALLELGZIP_HH_
+#define PARALLELGZIP_HH_
+
+#include <stdlib.h>
+#include <deque>
+#include <pthread.h>
+
+
+/**
+* ParallelGzip - pigz-like compressor: the content is split in blocks which are
+* deflated concurrently by a shared pool of worker threads (the calling thread
+* works too). Each block is primed with the last 32KB of the previous one, and
+* the deflate streams are concatenated into a single gzip member.
+*/
+class ParallelGzip
+{
+  struct Job;
+
+  static pthread_mutex_t poolMutex;
+  static pthread_cond_t poolCond;
+  static std::deque<Job*> jobs;
+  static unsigned nbThreads, nbStartedThreads;
+
+  static void startThreads();
+  static void* workerThread(void *);
+  static void processBlocks(Job *job);
+
+  public:
+
+    /**
+    * compress a content in the gzip format
+    * @param dst: set to the compressed content (to free)
+    * @param src: the content
+    * @param sizeSrc: the content length
+    * @param level: the zlib compression level
+    * @param strategy: the zlib compression strategy
+    * @param blockSize: the size of the blocks compressed in parallel (at least 32KB)
+    * @return the compressed content length (throw a std::runtime_error if failed)
+    */
+    static size_t gzip(unsigned char** dst, const unsigned char* src, const size_t sizeSrc,
+                       const int level, const int strategy, const size_t blockSize=128*1024);
+
+    /**
+    * set the number of worker threads, before the first compression
+    * @param n: the number of threads (Default value: the number of processors)
+    */
+    static void setNbThreads(const unsigned n);
+    static unsigned getNbThreads();
+};
+
+//****************************************************************************
+
+#endif
@@ -15,75 +15,150 @@
 #define PRECOMPILEDREPOSITORY_HH_
 
 #include <string>
-#include <map>
-#include "nvjThread.h"
+#include <string.h>
 
 #include "libnavajo/WebRepository.hh"
 
 
 class PrecompiledRepository : public WebRepository
 {
-    pthread_mutex_t _mutex;
-
+  public:
     struct WebStaticPage
     {
+      const char* url;
+      size_t urlLength;
       const unsigned char* data;
       size_t length;
-      WebStaticPage(const unsigned char* d,size_t l) : data(d), length(l) {};
-    } ;
+      const unsigned char* gzipData; // precompressed variant, or NULL
+      size_t gzipLength;
+      const char* mimeType;          // NULL: from the url extension
+      const char* etag;              // quoted strong entity tag, or NULL
+      const char* fingerprintedUrl;  // fingerprinted alias of the page, or NULL
+      bool immutable;                // a fingerprinted alias
+    };
+
+    /**
+    * FNV-1a hash of the url (with a murmur3 final mix), seeded by the perfect hash displacement
+    * (shared with navajoPrecompiler)
+    */
+    static inline unsigned hash(unsigned seed, const char* key, size_t len)
+    {
+      unsigned h = seed ? seed : 2166136261u;
+      for (size_t i=0; i<len; i++)
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+      // final mix: the low bits of FNV don't depend on the high bits of the seed
+      h ^= h >> 16; h *= 0x85ebca6bu;
+      h ^= h >> 13; h *= 0xc2b2ae35u;
+      return h ^ (h >> 16);
+    };
+
+  private:
+    // generated by navajoPrecompiler: the pages, and the minimal perfect hash
+    // table (hash and displace) indexing them
+    static const WebStaticPage pages[];
+    static const size_t nbPages;
+    static const int hashDisplacements[];
+    static std::string location;
+
+    /**
+    * find a page, without lock nor allocation (the tables are read-only)
+    * @param url: the url (without location)
+    * @param len: the url length
+    * @return the page, or NULL
+    */
+    static inline const WebStaticPage* find(const char* url, size_t len)
+    {
+      int d=hashDisplacements[hash(0, url, len) % nbPages];
+      const WebStaticPage *page = &pages[ d < 0 ? -d-1 : hash(d, url, len) % nbPages ];
+      if (page->urlLength != len || memcmp(page->url, url, len) != 0)
+        return NULL;
+      return page;
+    };
 
-    typedef std::map<std::string, const WebStaticPage> IndexMap;
-    static IndexMap indexMap;
-    static std::string location; 
-    
   public:
     PrecompiledRepository(const std::string& l="")
     { 
       location=l;
       while (location.size() && location[0]=='/') location.erase(0, 1);
       while (location.size() && location[location.size()-1]=='/') location.erase(location.size() - 1);
-      pthread_mutex_init(&_mutex, NULL);
-      if (!indexMap.size()) initIndexMap(); 
     };
-    virtual ~PrecompiledRepository() { indexMap.clear(); };
-    
-    static void initIndexMap();
+    virtual ~PrecompiledRepository() { };
 
     inline void freeFile(unsigned char *webpage) { };
 
     inline virtual bool getFile(HttpRequest* request, HttpResponse *response)
     {
-      std::string url = request->getUrl();
-      if (url.compare(0, location.length(), location) != 0)
+      const char *url = request->getUrl();
+      if (strncmp(url, location.c_str(), location.length()) != 0)
         return false;
 
-      url.erase(0, location.length());
-      while (url.size() && url[0]=='/') url.erase(0, 1);
-      if (!url.size()) url="index.html";
-      
-      size_t webpageLen;
-      unsigned char *webpage;
-      pthread_mutex_lock( &_mutex );
-      IndexMap::const_iterator i = indexMap.find (url);
-      if (i == indexMap.end())
+      url += location.length();
+      while (*url == '/') url++;
+      if (!*url) url="index.html";
+      size_t urlLen=strlen(url);
+
+      bool zipped=false;
+      const WebStaticPage* page=find(url, urlLen);
+      if (page == NULL)
       {
-        i = indexMap.find (url + ".gz");
-        if (i == indexMap.end())
-        {
-          pthread_mutex_unlock( &_mutex );
+        char gzUrl[1024];
+        if (urlLen + 4 > sizeof gzUrl)
           return false;
+        memcpy(gzUrl, url, urlLen);
+        memcpy(gzUrl + urlLen, ".gz", 4);
+        if ( (page=find(gzUrl, urlLen + 3)) == NULL )
+          return false;
+        zipped=true; // gzip file without identity variant
+      }
+
+      if (page->gzipData != NULL)
+        response->setVaryAcceptEncoding();
+
+      if (zipped)
+      {
+        response->setContent ((unsigned char*)page->data, page->length);
+        response->setIsZipped(true);
+      }
+      else
+        if (page->gzipData != NULL && request->getAcceptEncoding().isAccepted("gzip"))
+        {
+          response->setContent ((unsigned char*)page->gzipData, page->gzipLength);
+          response->setIsZipped(true);
+          if (page->etag != NULL)
+            response->setETag(std::string(page->etag, strlen(page->etag)-1) + "-gzip\"");
         }
         else
-          response->setIsZipped(true);
-      }
+        {
+          response->setContent ((unsigned char*)page->data, page->length);
+          if (page->etag != NULL)
+            response->setETag(page->etag);
+        }
 
-      webpage=(unsigned char*)((i->second).data); webpageLen=(i->second).length;
-      pthread_mutex_unlock( &_mutex );
-      response->setContent (webpage, webpageLen);
+      if (page->mimeType != NULL)
+        response->setMimeType(page->mimeType);
+      if (page->immutable)
+        response->setCacheControl(IMMUTABLE_CACHE_CONTROL);
+      response->setContentVersion("precompiled"); // never changes
       return true;
+    };
 
+    virtual void getRoutes(std::vector<WebRoute>& routes) { routes.push_back(WebRoute(location, true)); };
+
+    virtual std::string getFingerprintedUrl(const std::string& url)
+    {
+      size_t start=url.find_first_not_of('/');
+      if (start == std::string::npos || url.compare(start, location.length(), location) != 0)
+        return url;
+
+      size_t pageStart=url.find_first_not_of('/', start + location.length());
+      if (pageStart == std::string::npos || (location.length() && pageStart == start + location.length()))
+        return url;
+
+      const WebStaticPage* page=find(url.c_str() + pageStart, url.length() - pageStart);
+      if (page == NULL || page->fingerprintedUrl == NULL)
+        return url;
+      return url.substr(0, pageStart) + page->fingerprintedUrl;
     };
 };
 
 #endif
-
@@ -0,0 +1,80 @@
+//********************************************************
+/**
+ * @file  RepositoryRouter.hh
+ *
+ * @brief Dispatches the requests to the web repositories
+ *
+ * @version 1
+ */
+//********************************************************
+
+#ifndef REPOSITORYROUTER_HH_
+#define REPOSITORYROUTER_HH_
+
+#include <string>
+#include <vector>
+
+#include "libnavajo/WebRepository.hh"
+#include "libnavajo/nvjThread.h"
+
+
+/**
+* RepositoryRouter - compiles the routes of all the repositories in a trie,
+* giving for each url, in one pass, the repositories which may serve it
+* (in their registration order).
+* The tables are rebuilt when a repository is added or its routes change,
+* and published atomically: the lookups don't lock. Like the index of
+* LocalRepository, the readers of a table are counted by parity of an epoch,
+* and a replaced table is deleted once the readers of both parities have left.
+*/
+class RepositoryRouter
+{
+    struct Node
+    {
+      std::vector< std::pair<char, Node *> > children;
+      std::vector<WebRepository *> passing; // prefix routes ending here or above
+      std::vector<WebRepository *> ending;  // passing, and exact routes ending here
+    };
+
+    struct Table
+    {
+      Node *root;
+      unsigned generation;
+      std::vector<Node *> nodes;
+    };
+
+    pthread_mutex_t _mutex;
+    std::vector<WebRepository *> repositories;
+    Table *table;   // the published table (NULL: to rebuild)
+    Table *current; // the last table built (under _mutex)
+    volatile unsigned long tableReaders[2];
+    volatile unsigned tableEpoch;
+
+    static Node* getChild(const Node *node, char c);
+    static void deleteTable(Table *t);
+    void complete(Node *node, const std::vector<WebRepository *>& passing);
+    void rebuild();
+
+  public:
+    RepositoryRouter();
+    ~RepositoryRouter();
+
+    /**
+    * add a repository, after the previous ones
+    */
+    void add(WebRepository *repository);
+
+    /**
+    * compile the routes of the repositories
+    */
+    void build();
+
+    /**
+    * get the repositories which may serve an url
+    * @param url: the url
+    * @param repositories: set to the repositories, in their registration order
+    */
+    void lookup(const char *url, std::vector<WebRepository *>& repositories);
+};
+
+#endif
@@ -14,15 +14,115 @@
 #ifndef WEBREPOSITORY_HH_
 #define WEBREPOSITORY_HH_
 
+#include <string>
+#include <vector>
+#include <unistd.h>
+
 #include "HttpRequest.hh"
 #include "HttpResponse.hh"
+#include "CompressionPolicy.hh"
+
+#define FINGERPRINT_LENGTH 8
+#define IMMUTABLE_CACHE_CONTROL "public, max-age=31536000, immutable"
+
+
+/**
+* WebRoute - urls a repository may serve: an exact url, or all the urls
+* beginning with a prefix (without leading '/')
+*/
+struct WebRoute
+{
+  std::string url;
+  bool prefix;
+  WebRoute(const std::string& u, bool p) : url(u), prefix(p) {};
+};
 
 
 class WebRepository
 {
+    const CompressionPolicy *compressionPolicy;
+
+  protected:
+    /**
+    * to call when the routes of a repository change: the webservers
+    * rebuild their dispatch tables
+    */
+    static inline void routesChanged() { __atomic_add_fetch(&routesGeneration, 1, __ATOMIC_RELEASE); };
+
   public:
+    static volatile unsigned routesGeneration;
+
+    WebRepository() : compressionPolicy(NULL) {};
+    virtual ~WebRepository() {};
+
     virtual bool getFile(HttpRequest* request, HttpResponse *response) = 0;
     virtual void freeFile(unsigned char *webpage) = 0;
+
+    /**
+    * Release a content given with HttpResponse::setFileContent
+    * @param fd: the file descriptor (Default: closed)
+    */
+    virtual void freeFileContent(int fd) { close(fd); };
+
+    /**
+    * Report the urls which may be served, to dispatch the requests: getFile is
+    * only called for them. More urls than served may be reported, not less.
+    * @param routes: the routes to complete (Default: all the urls)
+    */
+    virtual void getRoutes(std::vector<WebRoute>& routes) { routes.push_back(WebRoute("", true)); };
+
+    /**
+    * Set the compression policy of the repository's contents
+    * @param policy: the policy (NULL: the webserver's policy is used)
+    */
+    inline void setCompressionPolicy(const CompressionPolicy *policy) { compressionPolicy=policy; };
+    inline const CompressionPolicy* getCompressionPolicy() const { return compressionPolicy; };
+
+    /**
+    * Get the fingerprinted alias of an url (ex: "js/app.js" -> "js/app.3f9a1c07.js"),
+    * served with an immutable Cache-Control
+    * @param url: the url
+    * @return the fingerprinted url, or the url if the repository has no alias for it
+    */
+    virtual std::string getFingerprintedUrl(const std::string& url) { return url; };
+
+    /**
+    * insert a fingerprint in an url, before the extension of the file name
+    * @param url: the url
+    * @param fingerprint: the fingerprint (FINGERPRINT_LENGTH hexadecimal digits)
+    * @return the fingerprinted url
+    */
+    static inline std::string fingerprintUrl(const std::string& url, const std::string& fingerprint)
+    {
+      size_t slash=url.rfind('/'), dot=url.rfind('.');
+      if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == (slash == std::string::npos ? 0 : slash+1))
+        return url+'.'+fingerprint;
+      return url.substr(0, dot)+'.'+fingerprint+url.substr(dot);
+    };
+
+    /**
+    * extract the fingerprint of a fingerprinted url
+    * @param url: the url
+    * @param original: set to the url without fingerprint
+    * @param fingerprint: set to the fingerprint
+    * @return false if the url has no fingerprint
+    */
+    static inline bool parseFingerprintedUrl(const std::string& url, std::string& original, std::string& fingerprint)
+    {
+      size_t slash=url.rfind('/');
+      for (size_t dot=url.rfind('.'); dot != std::string::npos && (slash == std::string::npos || dot > slash); dot=dot ? url.rfind('.', dot-1) : std::string::npos)
+      {
+        size_t end=dot+1+FINGERPRINT_LENGTH;
+        if (dot == (slash == std::string::npos ? 0 : slash+1) || end > url.size() || (end < url.size() && url[end] != '.'))
+          continue;
+        if (url.find_first_not_of("0123456789abcdef", dot+1) < end)
+          continue;
+        fingerprint=url.substr(dot+1, FINGERPRINT_LENGTH);
+        original=url.substr(0, dot)+url.substr(end);
+        return true;
+      }
+      return false;
+    };
 };
 
 #endif
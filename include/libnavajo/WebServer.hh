@@ -31,7 +31,11 @@
 #include "libnavajo/LogRecorder.hh"
 #include "libnavajo/IpAddress.hh"
 #include "libnavajo/WebRepository.hh"
+#include "libnavajo/RepositoryRouter.hh"
 #include "libnavajo/nvjThread.h"
+#include "libnavajo/CompressedContentCache.hh"
+
+#define NVJ_MAX_SERVER_SOCK 16
 
 
 class WebSocket;
@@ -55,8 +59,9 @@ class WebServer
     size_t recvLine(int client, char *bufLine, size_t);
     bool accept_request(ClientSockData* client);
     void fatalError(const char *);
-    static std::string getHttpHeader(const char *messageType, const size_t len=0, const bool keepAlive=true, const bool zipped=false, HttpResponse* response=NULL);
-    static const char* get_mime_type(const char *name);
+    static std::string getHttpHeader(const char *messageType, const size_t len=0, const bool keepAlive=true, const char *contentEncoding=NULL, HttpResponse* response=NULL, const bool varyAcceptEncoding=false);
+    static bool isETagMatching(const char *ifNoneMatch, const std::string& etag);
+    static std::string codedETag(const std::string& etag, const std::string& coding);
     u_short init();
 
     static std::string getNoContentErrorMsg();
@@ -78,8 +83,15 @@ class WebServer
     
     volatile bool exiting;
     volatile size_t exitedThread;
-    volatile int server_sock [ 3 ];
+    volatile int server_sock [ NVJ_MAX_SERVER_SOCK ];
     volatile size_t nbServerSock;
+    bool serverSockShared;
+    std::vector<int> inheritedSockets;
+    std::string socketsHandoffPath;
+    int socketsHandoffSock;
+    bool useInheritedSockets();
+    void initSocketsHandoff();
+    void serveSocketsHandoff();
     
     const static char authStr[];
 
@@ -112,7 +124,9 @@ class WebServer
     bool authPeerSsl;
     std::vector<std::string> authDnList;
     std::vector<IpNetwork> hostsAllowed;
-    std::vector<WebRepository *> webRepositories;
+    RepositoryRouter repositoryRouter;
+    CompressedContentCache compressedCache;
+    CompressionPolicy compressionPolicy;
     static inline bool is_base64(unsigned char c)
       { return (isalnum(c) || (c == '+') || (c == '/')); };
     static const std::string base64_chars;
@@ -127,6 +141,13 @@ class WebServer
 
   public:
     WebServer();
+
+    /**
+    * get the mime type from the file extension
+    * @param name: the filename
+    * @return the mime type, or NULL if unknown
+    */
+    static const char* get_mime_type(const char *name);
     
     /**
     * Set the web server name in the http header
@@ -204,10 +225,38 @@ class WebServer
     inline void setMutipartMaxCollectedDataLength(const long& max) { mutipartMaxCollectedDataLength = max; };    
     
     /**
-    * Add a web repository (containing web pages)
+    * Set the default compression policy (minimum size, level, strategy and compressible mime types).
+    * It can be overridden by repository (WebRepository::setCompressionPolicy) and by
+    * response (HttpResponse::setCompressionPolicy)
+    * @param policy: the new policy
+    */
+    inline void setCompressionPolicy(const CompressionPolicy& policy) { compressionPolicy = policy; };
+
+    /**
+    * Get the default compression policy
+    * @return the policy
+    */
+    inline CompressionPolicy& getCompressionPolicy() { return compressionPolicy; };
+
+    /**
+    * Set the size of the cache of compressed contents.
+    * Only the versioned contents are cached (see HttpResponse::setContentVersion)
+    * @param size: the maximum size in bytes, 0 to disable the cache (Default value: 16MB)
+    */
+    inline void setCompressedCacheSize(const size_t size) { compressedCache.setMaxSize(size); };
+
+    /**
+    * Get the cache of compressed contents (size, hits and misses counters)
+    * @return the cache
+    */
+    inline CompressedContentCache& getCompressedCache() { return compressedCache; };
+
+    /**
+    * Add a web repository (containing web pages). The requests are dispatched
+    * to the repositories reporting a route for them, in their registration order.
     * @param repo : a pointer to a WebRepository instance
     */  
-    void addRepository(WebRepository* repo) { webRepositories.push_back(repo); };
+    void addRepository(WebRepository* repo) { repositoryRouter.add(repo); };
 
     /**
     * Add a websocket
@@ -216,6 +265,31 @@ class WebServer
     */  
     void addWebSocket(const std::string endPoint, WebSocket* websocket) { webSocketEndPoints[endPoint]=websocket; };
     
+    /**
+    * Listen on an already bound socket instead of binding the tcp port
+    * (the socket is inherited from a previous process, or created by the application)
+    * Sockets passed by systemd (LISTEN_FDS/LISTEN_PID) are used automatically.
+    * @param fd : a listening socket descriptor
+    */
+    inline void addListeningSocket(const int fd) { inheritedSockets.push_back(fd); };
+
+    /**
+    * Receive the listening sockets of a running webserver through its handoff path.
+    * Must be called before startService. The previous process keeps serving
+    * until it's stopped: both processes accept connections meanwhile.
+    * The sockets are only received from a process of our user, within 5 seconds:
+    * else the tcp ports are bound as usual.
+    * @param path : the AF_UNIX socket path set by setSocketsHandoffPath in the previous process
+    * @return true if at least one listening socket has been received
+    */
+    bool inheritListeningSockets(const std::string& path);
+
+    /**
+    * Allow the next process to inherit our listening sockets through an AF_UNIX socket
+    * @param path : the AF_UNIX socket path
+    */
+    inline void setSocketsHandoffPath(const std::string& path) { socketsHandoffPath = path; };
+
     /**
     * IpV4 hosts only
     */  
@@ -250,6 +324,7 @@ class WebServer
     void startService()
     {
       NVJ_LOG->append(NVJ_INFO, "WebServer: Service is starting !");
+      repositoryRouter.build();
       create_thread( &threadWebServer, WebServer::startThread, this );
     };
     
@@ -280,6 +355,7 @@ class WebServer
     }
 
     static bool httpSend(ClientSockData *client, const void *buf, size_t len);
+    static bool httpSendFile(ClientSockData *client, int fd, size_t len);
 
     inline static void freeClientSockData(ClientSockData *c)
     {
@@ -1,7 +1,9 @@
 #include "libnavajo/LogRecorder.hh"
 #include "libnavajo/WebServer.hh"
+#include "libnavajo/MimeTypes.hh"
 #include "libnavajo/PrecompiledRepository.hh"
 #include "libnavajo/LocalRepository.hh"
+#include "libnavajo/BundleRepository.hh"
 #include "libnavajo/DynamicPage.hh"
 #include "libnavajo/DynamicRepository.hh"
 
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string>
 #include <stdexcept>
+#include <pthread.h>
  
 #include "zlib.h" 
 #if (ZLIB_VERNUM < 0x1271)
@@ -29,134 +30,257 @@
 
 
 //********************************************************
+/**
+* Per-thread zlib streams, reused by nvj_gzip and nvj_gunzip.
+* The streams are allocated once per thread (about 256KB each for deflate)
+* and reset between two calls, instead of being initialized every time.
+* (index 0: gzip format, index 1: raw deflate data)
+*/
 
-inline size_t nvj_gzip( unsigned char** dst, const unsigned char* src, const size_t sizeSrc, bool rawDeflateData=false )
+struct NvjZStreams
 {
-  z_stream strm;
-  size_t sizeDst=CHUNK;
+  z_stream deflateStrm[2], inflateStrm[2];
+  bool deflateInit[2], inflateInit[2];
+  int deflateLevel[2], deflateStrategy[2];
+};
 
-  /* allocate deflate state */
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
+inline void nvj_free_zstreams(void *p)
+{
+  NvjZStreams *zs=(NvjZStreams *)p;
+  for (int i=0; i<2; i++)
+  {
+    if (zs->deflateInit[i]) (void)deflateEnd(&zs->deflateStrm[i]);
+    if (zs->inflateInit[i]) (void)inflateEnd(&zs->inflateStrm[i]);
+  }
+  free(zs);
+}
 
-  if ( deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, rawDeflateData ? -15 : 16+MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
-    throw std::runtime_error(std::string("gzip : inflateInit2 error") );
+inline pthread_key_t& nvj_zstreams_key()
+{
+  static pthread_key_t key;
+  return key;
+}
 
-  if ( (*dst=(unsigned char *)malloc(CHUNK * sizeof (unsigned char))) == NULL )
-    throw std::runtime_error(std::string("gzip : malloc error (1)") );
+inline void nvj_create_zstreams_key()
+{
+  pthread_key_create(&nvj_zstreams_key(), nvj_free_zstreams);
+}
 
-  strm.avail_in = sizeSrc;
-  strm.next_in = (Bytef*)src;
+inline NvjZStreams* nvj_thread_zstreams()
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, nvj_create_zstreams_key);
 
-  int i=0;
-  
-  do 
+  NvjZStreams *zs=(NvjZStreams *)pthread_getspecific(nvj_zstreams_key());
+  if (zs == NULL)
   {
-    strm.avail_out = CHUNK;
-    strm.next_out = (Bytef*)*dst + i*CHUNK;
-    sizeDst=CHUNK * (i+1);
-  
-     if (deflate(&strm, Z_FINISH ) == Z_STREAM_ERROR)  /* state not clobbered */
-    {
-      free (*dst);
-      throw std::runtime_error(std::string("gzip : deflate error") );
-    }
+    if ( (zs=(NvjZStreams *)calloc(1, sizeof(NvjZStreams))) == NULL )
+      throw std::runtime_error(std::string("gzip : malloc error (streams)") );
+    pthread_setspecific(nvj_zstreams_key(), zs);
+  }
+  return zs;
+}
 
-    i++;
-  
-    if (strm.avail_out == 0)
-    {
-      unsigned char* reallocDst = (unsigned char*) realloc (*dst, CHUNK * (i+1) * sizeof (unsigned char) );
+//********************************************************
 
-      if (reallocDst!=NULL)
-        *dst=reallocDst;
-       else
-      {
-        free (reallocDst);
-        free (*dst);
-        throw std::runtime_error(std::string("gzip : (re)allocating memory") );
-      }
-    }
+inline z_stream* nvj_thread_deflate_stream( bool rawDeflateData=false, int level=Z_BEST_SPEED, int strategy=Z_DEFAULT_STRATEGY )
+{
+  NvjZStreams *zs=nvj_thread_zstreams();
+  int i=rawDeflateData ? 1 : 0;
+  z_stream *strm=&zs->deflateStrm[i];
+
+  if (!zs->deflateInit[i])
+  {
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    if ( deflateInit2(strm, level, Z_DEFLATED, rawDeflateData ? -15 : 16+MAX_WBITS, 9, strategy) != Z_OK)
+      throw std::runtime_error(std::string("gzip : deflateInit2 error") );
+    zs->deflateInit[i]=true;
+  }
+  else
+  {
+    deflateReset(strm);
+    if ( (zs->deflateLevel[i] != level || zs->deflateStrategy[i] != strategy)
+      && deflateParams(strm, level, strategy) != Z_OK )
+      throw std::runtime_error(std::string("gzip : deflateParams error") );
   }
-  while (strm.avail_out == 0);
+  zs->deflateLevel[i]=level;
+  zs->deflateStrategy[i]=strategy;
 
-  /* clean up and return */
-  (void)deflateEnd(&strm);
-  return sizeDst - strm.avail_out;
+  return strm;
 }
 
 //********************************************************
 
-inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const size_t sizeSrc, bool rawDeflateData=false )
+inline z_stream* nvj_thread_inflate_stream( bool rawDeflateData=false )
 {
-  z_stream strm;
-  size_t sizeDst=CHUNK;
+  NvjZStreams *zs=nvj_thread_zstreams();
+  int i=rawDeflateData ? 1 : 0;
+  z_stream *strm=&zs->inflateStrm[i];
+
+  if (!zs->inflateInit[i])
+  {
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    strm->avail_in = 0;
+    strm->next_in = Z_NULL;
+    if (inflateInit2(strm, rawDeflateData ? -15 : 16+MAX_WBITS) != Z_OK)
+      throw std::runtime_error(std::string("gunzip : inflateInit2 error") );
+    zs->inflateInit[i]=true;
+  }
+  else
+    inflateReset(strm);
+
+  return strm;
+}
+
+//********************************************************
+/**
+* compress with a stream returned by nvj_thread_deflate_stream
+* @param dst: the destination buffer, at least deflateBound(strm, sizeSrc) bytes
+* @return the compressed size
+*/
+inline size_t nvj_deflate_buffer( z_stream* strm, unsigned char* dst, const size_t sizeDst, const unsigned char* src, const size_t sizeSrc )
+{
+  // zlib counts in uInt: feed it by slices
+  const size_t maxSlice=1<<30;
+  size_t remainIn=sizeSrc, remainOut=sizeDst;
+  strm->next_in = (Bytef*)src;
+  strm->next_out = (Bytef*)dst;
+
   int ret;
+  do
+  {
+    size_t in = remainIn > maxSlice ? maxSlice : remainIn;
+    size_t out = remainOut > maxSlice ? maxSlice : remainOut;
+    strm->avail_in = in;
+    strm->avail_out = out;
 
-  if (src == NULL)
-    throw std::runtime_error(std::string("gunzip : src == NULL !") );
+    ret=deflate(strm, in == remainIn ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_ERROR || (ret == Z_BUF_ERROR && strm->avail_out == 0))
+      throw std::runtime_error(std::string("gzip : deflate error") );
 
-  /* allocate inflate state */
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = Z_NULL;
+    remainIn -= in - strm->avail_in;
+    remainOut -= out - strm->avail_out;
+  }
+  while (ret != Z_STREAM_END);
 
+  return sizeDst - remainOut;
+}
 
-  if (inflateInit2(&strm, rawDeflateData ? -15 : 16+MAX_WBITS) != Z_OK)
-    throw std::runtime_error(std::string("gunzip : inflateInit2 error") );
+//********************************************************
+/**
+* compress directly into a caller's buffer (the send buffer for example)
+* @param dst: the destination buffer, at least nvj_gzip_bound(sizeSrc) bytes
+* @return the compressed size
+*/
+inline size_t nvj_gzip_to( unsigned char* dst, const size_t sizeDst, const unsigned char* src, const size_t sizeSrc, bool rawDeflateData=false, int level=Z_BEST_SPEED, int strategy=Z_DEFAULT_STRATEGY )
+{
+  return nvj_deflate_buffer(nvj_thread_deflate_stream(rawDeflateData, level, strategy), dst, sizeDst, src, sizeSrc);
+}
+
+//********************************************************
+/**
+* @return the maximum size of the compressed data
+*/
+inline size_t nvj_gzip_bound( const size_t sizeSrc, bool rawDeflateData=false, int level=Z_BEST_SPEED, int strategy=Z_DEFAULT_STRATEGY )
+{
+  return deflateBound(nvj_thread_deflate_stream(rawDeflateData, level, strategy), sizeSrc);
+}
+
+//********************************************************
+
+inline size_t nvj_gzip( unsigned char** dst, const unsigned char* src, const size_t sizeSrc, bool rawDeflateData=false, int level=Z_BEST_SPEED, int strategy=Z_DEFAULT_STRATEGY )
+{
+  z_stream *strm=nvj_thread_deflate_stream(rawDeflateData, level, strategy);
+
+  // one allocation, large enough for the worst case
+  size_t sizeDst=deflateBound(strm, sizeSrc);
+  if ( (*dst=(unsigned char *)malloc(sizeDst * sizeof (unsigned char))) == NULL )
+    throw std::runtime_error(std::string("gzip : malloc error (1)") );
+
+  try
+  {
+    return nvj_deflate_buffer(strm, *dst, sizeDst, src, sizeSrc);
+  }
+  catch (...)
+  {
+    free (*dst);
+    throw;
+  }
+}
+
+//********************************************************
 
-  if ( (*dst=(unsigned char *)malloc(CHUNK * sizeof (unsigned char))) == NULL )
+inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const size_t sizeSrc, bool rawDeflateData=false )
+{
+  if (src == NULL)
+    throw std::runtime_error(std::string("gunzip : src == NULL !") );
+
+  z_stream *strm=nvj_thread_inflate_stream(rawDeflateData);
+
+  // the gzip trailer gives the uncompressed size (modulo 2^32)
+  size_t sizeDst=0;
+  if (!rawDeflateData && sizeSrc >= 18)
+    sizeDst = src[sizeSrc-4] | (src[sizeSrc-3] << 8) | (src[sizeSrc-2] << 16) | ((size_t)src[sizeSrc-1] << 24);
+  if (sizeDst < sizeSrc)
+    sizeDst = 4 * sizeSrc;
+  if (sizeDst < CHUNK)
+    sizeDst = CHUNK;
+  sizeDst++; // room to detect the end of stream
+
+  if ( (*dst=(unsigned char *)malloc(sizeDst * sizeof (unsigned char))) == NULL )
     throw std::runtime_error(std::string("gunzip : malloc error (2)") );
 
-  strm.avail_in = sizeSrc;
-  strm.next_in = (Bytef*)src;
+  const size_t maxSlice=1<<30;
+  size_t posIn=0, posOut=0;
+  int ret;
 
-  int i=0;
- 
   do
   {
-    strm.avail_out = CHUNK;
-    strm.next_out = (Bytef*)*dst + i*CHUNK;
-    sizeDst=CHUNK * (i+1);
+    if (posOut == sizeDst)
+    {
+      // geometric growth: linear copying cost overall
+      unsigned char* reallocDst = (unsigned char*) realloc (*dst, 2 * sizeDst * sizeof (unsigned char) );
+      if (reallocDst == NULL)
+      {
+        free (*dst);
+        throw std::runtime_error(std::string("gunzip : (re)allocating memory") );
+      }
+      *dst=reallocDst;
+      sizeDst*=2;
+    }
 
-    ret = inflate(&strm, Z_NO_FLUSH);
+    size_t in = sizeSrc - posIn > maxSlice ? maxSlice : sizeSrc - posIn;
+    size_t out = sizeDst - posOut > maxSlice ? maxSlice : sizeDst - posOut;
+    strm->next_in = (Bytef*)src + posIn;
+    strm->avail_in = in;
+    strm->next_out = (Bytef*)*dst + posOut;
+    strm->avail_out = out;
 
-    switch (ret) 
+    ret = inflate(strm, Z_NO_FLUSH);
+
+    switch (ret)
     {
       case Z_STREAM_ERROR:
-        free (*dst);
-        throw std::runtime_error(std::string("gunzip : inflate Z_STREAM_ERROR") );
       case Z_NEED_DICT:
       case Z_DATA_ERROR:
       case Z_MEM_ERROR:
-        (void)inflateEnd(&strm);
         free (*dst);
         throw std::runtime_error(std::string("gunzip : inflate error") );
     }
-  
-    i++;
-     if (strm.avail_out == 0)
-     {
-      unsigned char* reallocDst = (unsigned char*) realloc (*dst, CHUNK * (i+1) * sizeof (unsigned char) );
 
-      if (reallocDst!=NULL)
-        *dst=reallocDst;
-      else
-      {
-        free (reallocDst);
-        free (*dst);
-        throw std::runtime_error(std::string("gunzip : (re)allocating memory") );
-      }
-    }
+    posIn += in - strm->avail_in;
+    posOut += out - strm->avail_out;
+
+    if (ret == Z_BUF_ERROR && posIn == sizeSrc && posOut < sizeDst)
+      break; // truncated input
   }
-  while (strm.avail_out == 0);
+  while (ret != Z_STREAM_END);
 
-  /* clean up and return */
-  (void)inflateEnd(&strm);
-  return sizeDst - strm.avail_out;
+  return posOut;
 }
 
 //----------------------------------------------------------------------------------------
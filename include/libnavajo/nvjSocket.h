@@ -196,5 +196,164 @@ inline bool setSocketNagleAlgo(int socket, bool naggle = false)
   return setsockopt(socket,IPPROTO_TCP,TCP_NODELAY,(char *)&flag,sizeof(flag)) == 0;
 }
 
+#ifndef WIN32
+
+#include <sys/un.h>
+#include <fcntl.h>
+
+/***********************************************************************
+* isListeningSocket:  Check the descriptor is a listening stream socket
+* @param socket   - socket descriptor
+* \return true if the socket accepts connections, otherwise false
+***********************************************************************/
+
+inline bool isListeningSocket(int socket)
+{
+  int type=0, accepting=0;
+  socklen_t len = sizeof(type);
+  if ( getsockopt( socket, SOL_SOCKET, SO_TYPE, &type, &len ) != 0 || type != SOCK_STREAM )
+    return false;
+#if defined(SO_ACCEPTCONN)
+  len = sizeof(accepting);
+  if ( getsockopt( socket, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len ) != 0 )
+    return false;
+  return accepting != 0;
+#else
+  return true;
 #endif
+}
+
+/***********************************************************************
+* setSocketCloseOnExec:  Close (or keep) the socket across exec()
+* @param socket   - socket descriptor
+* @param cloexec  - close on exec : true by default
+* \return true is successful, otherwise false
+***********************************************************************/
+
+inline bool setSocketCloseOnExec(int socket, bool cloexec = true)
+{
+  int flags = fcntl(socket, F_GETFD);
+  if (flags == -1) return false;
+  flags = cloexec ? (flags | FD_CLOEXEC) : (flags & ~FD_CLOEXEC);
+  return fcntl(socket, F_SETFD, flags) == 0;
+}
 
+/***********************************************************************
+* setSocketNonBlocking:  Non blocking mode for the socket
+* @param socket      - socket descriptor
+* @param nonBlocking - use non blocking mode : true by default
+* \return true is successful, otherwise false
+***********************************************************************/
+
+inline bool setSocketNonBlocking(int socket, bool nonBlocking = true)
+{
+  int flags = fcntl(socket, F_GETFL);
+  if (flags == -1) return false;
+  flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  return fcntl(socket, F_SETFL, flags) == 0;
+}
+
+/***********************************************************************
+* isSocketPeerUser:  Check the peer of an AF_UNIX socket runs as our user
+* @param unixSocket - a connected AF_UNIX socket
+* \return true if the peer process has our effective uid, otherwise false
+***********************************************************************/
+
+inline bool isSocketPeerUser(int unixSocket)
+{
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if ( getsockopt( unixSocket, SOL_SOCKET, SO_PEERCRED, &cred, &len ) != 0 || len != sizeof(cred) )
+    return false;
+  return cred.uid == geteuid();
+}
+
+/***********************************************************************
+* sendSocketDescriptors:  Pass descriptors to a peer process (SCM_RIGHTS)
+* @param unixSocket - a connected AF_UNIX socket
+* @param fds        - the descriptors to pass
+* @param nbFds      - the number of descriptors
+* \return true is successful, otherwise false
+***********************************************************************/
+
+inline bool sendSocketDescriptors(int unixSocket, const int *fds, size_t nbFds)
+{
+  if (!nbFds || nbFds > 64) return false;
+
+  char cmsgBuf[ CMSG_SPACE( 64 * sizeof(int) ) ];
+  memset(cmsgBuf, 0, sizeof cmsgBuf);
+  unsigned char count = (unsigned char)nbFds;
+  struct iovec iov;
+  iov.iov_base = &count;
+  iov.iov_len = 1;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgBuf;
+  msg.msg_controllen = CMSG_SPACE( nbFds * sizeof(int) );
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN( nbFds * sizeof(int) );
+  memcpy(CMSG_DATA(cmsg), fds, nbFds * sizeof(int));
+
+  return sendmsg(unixSocket, &msg, 0) == 1;
+}
+
+/***********************************************************************
+* recvSocketDescriptors:  Receive descriptors from a peer process
+* @param unixSocket - a connected AF_UNIX socket
+* @param fds        - array filled with the received descriptors
+* @param maxFds     - the size of the fds array
+* @param timeout    - the maximum waiting time in ms (negative: no limit)
+* \return the number of descriptors received
+***********************************************************************/
+
+inline size_t recvSocketDescriptors(int unixSocket, int *fds, size_t maxFds, int timeout=-1)
+{
+  char cmsgBuf[ CMSG_SPACE( 64 * sizeof(int) ) ];
+  unsigned char count = 0;
+  struct iovec iov;
+  iov.iov_base = &count;
+  iov.iov_len = 1;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgBuf;
+  msg.msg_controllen = sizeof cmsgBuf;
+
+  struct pollfd pfd;
+  pfd.fd = unixSocket;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (timeout >= 0 && poll(&pfd, 1, timeout) != 1)
+    return 0;
+
+  if (recvmsg(unixSocket, &msg, timeout >= 0 ? MSG_DONTWAIT : 0) != 1)
+    return 0;
+
+  size_t nb = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int *received = (const int *)CMSG_DATA(cmsg);
+    for (size_t i = 0; i < n; i++)
+      if (nb < maxFds)
+        fds[nb++] = received[i];
+      else
+        close(received[i]);
+  }
+
+  return nb;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,316 @@
+//********************************************************
+/**
+ * @file  BundleRepository.cc
+ *
+ * @brief Handles a web repository packed in a bundle file,
+ *        mapped in memory at runtime
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/BundleRepository.hh"
+#include "libnavajo/PrecompiledRepository.hh"
+
+
+/**********************************************************************/
+
+BundleRepository::BundleRepository(const std::string& l, const std::string& p) : current(NULL), location(l), path(p)
+{
+  pthread_mutex_init(&_mutex, NULL);
+
+  while (location.size() && location[0]=='/') location.erase(0, 1);
+  while (location.size() && location[location.size()-1]=='/') location.erase(location.size() - 1);
+
+  load();
+}
+
+/**********************************************************************/
+
+BundleRepository::~BundleRepository()
+{
+  if (current != NULL)
+    unmap(current);
+  for (std::list<Bundle *>::iterator it=retired.begin(); it!=retired.end(); it++)
+    unmap(*it);
+  pthread_mutex_destroy(&_mutex);
+}
+
+/**********************************************************************/
+
+static inline bool inRange(uint64_t offset, uint64_t length, uint64_t size)
+{
+  return offset <= size && length <= size - offset;
+}
+
+static inline bool isString(const char *map, uint64_t offset, uint64_t size)
+{
+  return !offset || (offset < size && memchr(map + offset, '\0', size - offset) != NULL);
+}
+
+/**********************************************************************/
+/**
+* map a bundle file, and check its consistency
+* @param path: the bundle file
+* @return the bundle, or NULL if invalid
+*/
+BundleRepository::Bundle* BundleRepository::map(const std::string& path)
+{
+  int fd=open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "BundleRepository - can't open '" + path + "' : " + strerror(errno));
+    return NULL;
+  }
+
+  struct stat s;
+  void *map=MAP_FAILED;
+  if (fstat(fd, &s) == 0 && (size_t)s.st_size >= sizeof(BundleHeader))
+    map=mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "BundleRepository - can't map '" + path + "'");
+    return NULL;
+  }
+
+  Bundle *bundle=new Bundle;
+  bundle->map=map;
+  bundle->size=s.st_size;
+  bundle->header=(const BundleHeader *)map;
+  bundle->refCount=0;
+
+  const char *base=(const char *)map;
+  const BundleHeader *header=bundle->header;
+  uint64_t size=bundle->size;
+  bool valid = !memcmp(header->magic, BUNDLE_MAGIC, sizeof header->magic)
+    && header->version == BUNDLE_VERSION && header->size == size && header->nbPages
+    && !(header->pagesOffset % sizeof(uint64_t)) && !(header->displacementsOffset % sizeof(int32_t))
+    && inRange(header->pagesOffset, (uint64_t)header->nbPages * sizeof(BundlePage), size)
+    && inRange(header->displacementsOffset, (uint64_t)header->nbPages * sizeof(int32_t), size);
+
+  if (valid)
+  {
+    bundle->pages=(const BundlePage *)(base + header->pagesOffset);
+    bundle->displacements=(const int32_t *)(base + header->displacementsOffset);
+
+    for (uint32_t i=0; valid && i<header->nbPages; i++)
+    {
+      const BundlePage& page=bundle->pages[i];
+      int32_t d=bundle->displacements[i];
+      valid = (d >= 0 || (uint32_t)(-(d+1)) < header->nbPages)
+        && page.urlOffset && inRange(page.urlOffset, page.urlLength, size)
+        && inRange(page.dataOffset, page.length, size)
+        && inRange(page.gzipOffset, page.gzipLength, size)
+        && isString(base, page.mimeTypeOffset, size) && isString(base, page.etagOffset, size)
+        && isString(base, page.fingerprintedUrlOffset, size);
+    }
+  }
+
+  if (!valid)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "BundleRepository - invalid bundle '" + path + "'");
+    unmap(bundle);
+    return NULL;
+  }
+
+  return bundle;
+}
+
+/**********************************************************************/
+
+void BundleRepository::unmap(Bundle *bundle)
+{
+  munmap(bundle->map, bundle->size);
+  delete bundle;
+}
+
+/**********************************************************************/
+
+bool BundleRepository::load(const std::string& p)
+{
+  std::string bundlePath=p.size() ? p : path;
+  Bundle *bundle=map(bundlePath);
+  if (bundle == NULL)
+    return false;
+
+  pthread_mutex_lock( &_mutex );
+  Bundle *previous=current;
+  current=bundle;
+  path=bundlePath;
+  bool unused = previous != NULL && !previous->refCount;
+  if (previous != NULL && !unused)
+    retired.push_back(previous);
+  pthread_mutex_unlock( &_mutex );
+
+  if (unused)
+    unmap(previous);
+  return true;
+}
+
+/**********************************************************************/
+
+BundleRepository::Bundle* BundleRepository::acquire()
+{
+  pthread_mutex_lock( &_mutex );
+  Bundle *bundle=current;
+  if (bundle != NULL)
+    bundle->refCount++;
+  pthread_mutex_unlock( &_mutex );
+  return bundle;
+}
+
+/**********************************************************************/
+
+void BundleRepository::release(Bundle *bundle)
+{
+  pthread_mutex_lock( &_mutex );
+  bool unused = !--bundle->refCount && bundle != current;
+  if (unused)
+    retired.remove(bundle);
+  pthread_mutex_unlock( &_mutex );
+
+  if (unused)
+    unmap(bundle);
+}
+
+/**********************************************************************/
+
+const BundlePage* BundleRepository::find(const Bundle *bundle, const char* url, size_t len)
+{
+  uint32_t nbPages=bundle->header->nbPages;
+  int32_t d=bundle->displacements[PrecompiledRepository::hash(0, url, len) % nbPages];
+  const BundlePage *page=&bundle->pages[ d < 0 ? -d-1 : PrecompiledRepository::hash(d, url, len) % nbPages ];
+  if (page->urlLength != len || memcmp((const char*)bundle->map + page->urlOffset, url, len) != 0)
+    return NULL;
+  return page;
+}
+
+/**********************************************************************/
+
+bool BundleRepository::getFile(HttpRequest* request, HttpResponse *response)
+{
+  const char *url = request->getUrl();
+  if (strncmp(url, location.c_str(), location.length()) != 0)
+    return false;
+
+  url += location.length();
+  while (*url == '/') url++;
+  if (!*url) url="index.html";
+  size_t urlLen=strlen(url);
+
+  Bundle *bundle=acquire();
+  if (bundle == NULL)
+    return false;
+
+  bool zipped=false;
+  const BundlePage* page=find(bundle, url, urlLen);
+  if (page == NULL)
+  {
+    std::string gzUrl=std::string(url, urlLen)+".gz";
+    if ( (page=find(bundle, gzUrl.c_str(), gzUrl.size())) == NULL )
+    {
+      release(bundle);
+      return false;
+    }
+    zipped=true; // gzip file without identity variant
+  }
+
+  unsigned char *base=(unsigned char *)bundle->map;
+  const char *etag=string(bundle, page->etagOffset);
+
+  if (page->gzipOffset)
+    response->setVaryAcceptEncoding();
+
+  size_t length;
+  if (zipped)
+  {
+    response->setContent (base + page->dataOffset, length=page->length);
+    response->setIsZipped(true);
+  }
+  else
+    if (page->gzipOffset && request->getAcceptEncoding().isAccepted("gzip"))
+    {
+      response->setContent (base + page->gzipOffset, length=page->gzipLength);
+      response->setIsZipped(true);
+      if (etag != NULL)
+        response->setETag(std::string(etag, strlen(etag)-1) + "-gzip\"");
+    }
+    else
+    {
+      response->setContent (base + page->dataOffset, length=page->length);
+      if (etag != NULL)
+        response->setETag(etag);
+    }
+
+  if (page->mimeTypeOffset)
+    response->setMimeType(string(bundle, page->mimeTypeOffset));
+  if (page->immutable)
+    response->setCacheControl(IMMUTABLE_CACHE_CONTROL);
+  response->setContentVersion(etag != NULL ? etag : "bundle");
+
+  // an empty page isn't given back by freeFile: its offset may be the end of
+  // the mapping, where another bundle can be mapped
+  if (!length)
+  {
+    response->setContent (NULL, 0);
+    release(bundle);
+  }
+  return true;
+}
+
+/**********************************************************************/
+/**
+* release the bundle which contains the page
+*/
+void BundleRepository::freeFile(unsigned char *webpage)
+{
+  Bundle *bundle=NULL;
+
+  pthread_mutex_lock( &_mutex );
+  std::list<Bundle *>::iterator it=retired.begin();
+  for (Bundle *b=current; b != NULL; b = it != retired.end() ? *it++ : NULL)
+    if (webpage >= (unsigned char *)b->map && webpage < (unsigned char *)b->map + b->size)
+    {
+      bundle=b;
+      break;
+    }
+  pthread_mutex_unlock( &_mutex );
+
+  if (bundle != NULL)
+    release(bundle);
+}
+
+/**********************************************************************/
+
+std::string BundleRepository::getFingerprintedUrl(const std::string& url)
+{
+  size_t start=url.find_first_not_of('/');
+  if (start == std::string::npos || url.compare(start, location.length(), location) != 0)
+    return url;
+
+  size_t pageStart=url.find_first_not_of('/', start + location.length());
+  if (pageStart == std::string::npos || (location.length() && pageStart == start + location.length()))
+    return url;
+
+  std::string fingerprinted=url;
+  Bundle *bundle=acquire();
+  if (bundle == NULL)
+    return url;
+
+  const BundlePage* page=find(bundle, url.c_str() + pageStart, url.length() - pageStart);
+  if (page != NULL && page->fingerprintedUrlOffset)
+    fingerprinted=url.substr(0, pageStart) + string(bundle, page->fingerprintedUrlOffset);
+  release(bundle);
+
+  return fingerprinted;
+}
@@ -0,0 +1,202 @@
+//********************************************************
+/**
+ * @file  CompressedContentCache.cc
+ *
+ * @brief Bounded cache of compressed responses
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <stdio.h>
+#include "libnavajo/CompressedContentCache.hh"
+
+
+/**********************************************************************/
+
+CompressedContentCache::CompressedContentCache(const size_t max, const unsigned nb)
+{
+  nbShards = nb ? nb : 1;
+  maxSize = max;
+  hits = misses = 0;
+  shards = new Shard[nbShards];
+  for (unsigned i=0; i<nbShards; i++)
+  {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+    shards[i].size = 0;
+  }
+}
+
+/**********************************************************************/
+
+CompressedContentCache::~CompressedContentCache()
+{
+  clear();
+  for (unsigned i=0; i<nbShards; i++)
+    pthread_mutex_destroy(&shards[i].mutex);
+  delete [] shards;
+}
+
+/**********************************************************************/
+
+std::string CompressedContentCache::getKey(const void* repo, const std::string& url, const char* coding, const CompressionPolicy& policy)
+{
+  char prefix[96];
+  snprintf(prefix, sizeof prefix, "%p %s/%d/%d ", repo, coding, policy.getLevel(), policy.getStrategy());
+  return std::string(prefix) + url;
+}
+
+/**********************************************************************/
+
+CompressedContentCache::Shard& CompressedContentCache::getShard(const std::string& key)
+{
+  // FNV-1a
+  unsigned h=2166136261u;
+  for (size_t i=0; i<key.size(); i++)
+    h = (h ^ (unsigned char)key[i]) * 16777619u;
+  return shards[h % nbShards];
+}
+
+/**********************************************************************/
+
+CompressedContentCache::Entry* CompressedContentCache::get(const void* repo, const std::string& url, const std::string& version, const char* coding,
+                                                            const CompressionPolicy& policy)
+{
+  std::string key=getKey(repo, url, coding, policy);
+  Shard& shard=getShard(key);
+
+  pthread_mutex_lock( &shard.mutex );
+  std::map<std::string, Entry*>::iterator it = shard.entries.find(key);
+  if (it == shard.entries.end())
+  {
+    pthread_mutex_unlock( &shard.mutex );
+    __sync_fetch_and_add(&misses, 1);
+    return NULL;
+  }
+
+  Entry *entry=it->second;
+  if (entry->version != version)
+  {
+    // outdated content
+    removeEntry(shard, it);
+    pthread_mutex_unlock( &shard.mutex );
+    __sync_fetch_and_add(&misses, 1);
+    return NULL;
+  }
+
+  shard.lru.splice(shard.lru.begin(), shard.lru, entry->lruPos);
+  __sync_fetch_and_add(&entry->refCount, 1);
+  pthread_mutex_unlock( &shard.mutex );
+  __sync_fetch_and_add(&hits, 1);
+  return entry;
+}
+
+/**********************************************************************/
+
+CompressedContentCache::Entry* CompressedContentCache::put(const void* repo, const std::string& url, const std::string& version, const char* coding,
+                                                           const CompressionPolicy& policy, unsigned char* data, const size_t length)
+{
+  std::string key=getKey(repo, url, coding, policy);
+  Entry *entry=new Entry(key, version, data, length);
+
+  Shard& shard=getShard(key);
+  if (length > maxSize / nbShards)
+    return entry; // too big: not cached, only owned by the caller
+
+  pthread_mutex_lock( &shard.mutex );
+  std::map<std::string, Entry*>::iterator it = shard.entries.find(key);
+  if (it != shard.entries.end())
+    removeEntry(shard, it);
+
+  __sync_fetch_and_add(&entry->refCount, 1); // the cache reference
+  shard.lru.push_front(entry);
+  entry->lruPos=shard.lru.begin();
+  shard.entries[key]=entry;
+  shard.size+=length;
+  evict(shard);
+  pthread_mutex_unlock( &shard.mutex );
+
+  return entry;
+}
+
+/**********************************************************************/
+
+void CompressedContentCache::release(Entry* entry)
+{
+  if (entry != NULL && __sync_sub_and_fetch(&entry->refCount, 1) == 0)
+    delete entry;
+}
+
+/**********************************************************************/
+
+void CompressedContentCache::removeEntry(Shard& shard, std::map<std::string, Entry*>::iterator it)
+{
+  Entry *entry=it->second;
+  shard.lru.erase(entry->lruPos);
+  shard.size-=entry->length;
+  shard.entries.erase(it);
+  release(entry);
+}
+
+/**********************************************************************/
+
+void CompressedContentCache::evict(Shard& shard)
+{
+  size_t maxShardSize=maxSize / nbShards;
+  while (shard.size > maxShardSize && !shard.lru.empty())
+    removeEntry(shard, shard.entries.find(shard.lru.back()->key));
+}
+
+/**********************************************************************/
+
+void CompressedContentCache::setMaxSize(const size_t max)
+{
+  maxSize=max;
+  for (unsigned i=0; i<nbShards; i++)
+  {
+    pthread_mutex_lock( &shards[i].mutex );
+    evict(shards[i]);
+    pthread_mutex_unlock( &shards[i].mutex );
+  }
+}
+
+/**********************************************************************/
+
+size_t CompressedContentCache::getSize()
+{
+  size_t size=0;
+  for (unsigned i=0; i<nbShards; i++)
+  {
+    pthread_mutex_lock( &shards[i].mutex );
+    size+=shards[i].size;
+    pthread_mutex_unlock( &shards[i].mutex );
+  }
+  return size;
+}
+
+/**********************************************************************/
+
+size_t CompressedContentCache::getNbEntries()
+{
+  size_t nb=0;
+  for (unsigned i=0; i<nbShards; i++)
+  {
+    pthread_mutex_lock( &shards[i].mutex );
+    nb+=shards[i].entries.size();
+    pthread_mutex_unlock( &shards[i].mutex );
+  }
+  return nb;
+}
+
+/**********************************************************************/
+
+void CompressedContentCache::clear()
+{
+  for (unsigned i=0; i<nbShards; i++)
+  {
+    pthread_mutex_lock( &shards[i].mutex );
+    while (!shards[i].entries.empty())
+      removeEntry(shards[i], shards[i].entries.begin());
+    pthread_mutex_unlock( &shards[i].mutex );
+  }
+}
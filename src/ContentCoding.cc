@@ -0,0 +1,300 @@
+//********************************************************
+/**
+ * @file  ContentCoding.cc
+ *
+ * @brief HTTP content codings (gzip, deflate, br, zstd) and
+ *        Accept-Encoding negotiation (rfc7231)
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "libnavajo/ContentCoding.hh"
+#include "libnavajo/nvjGzip.h"
+#include "libnavajo/ParallelGzip.hh"
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+/**********************************************************************/
+
+void AcceptEncoding::parse(const char *value)
+{
+  codings.clear();
+  if (value == NULL) return;
+
+  const char *p=value;
+  while (*p)
+  {
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    if (!*p) break;
+
+    const char *nameStart=p;
+    while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+    std::string name(nameStart, p-nameStart);
+    for (size_t i=0; i<name.size(); i++)
+      name[i]=tolower(name[i]);
+
+    // parameters: only q is meaningful
+    float q=1;
+    while (*p && *p != ',')
+    {
+      if (*p == ';')
+      {
+        p++;
+        while (*p == ' ' || *p == '\t') p++;
+        if ((*p == 'q' || *p == 'Q') && *(p+1) == '=')
+        {
+          q=(float)strtod(p+2, NULL);
+          if (q < 0) q=0;
+          if (q > 1) q=1;
+        }
+      }
+      else
+        p++;
+    }
+
+    if (name.size())
+      codings.push_back(std::pair<std::string, float>(name, q));
+  }
+}
+
+/**********************************************************************/
+
+float AcceptEncoding::getQValue(const std::string& name) const
+{
+  float wildcard=-1;
+  for (std::vector< std::pair<std::string, float> >::const_iterator it=codings.begin(); it!=codings.end(); it++)
+  {
+    if (it->first == name)
+      return it->second;
+    if (it->first == "*")
+      wildcard=it->second;
+  }
+
+  if (wildcard >= 0)
+    return wildcard;
+
+  // identity is always acceptable, unless explicitly excluded
+  return name == "identity" ? 1 : 0;
+}
+
+/**********************************************************************/
+
+bool AcceptEncoding::isListed(const std::string& name) const
+{
+  for (std::vector< std::pair<std::string, float> >::const_iterator it=codings.begin(); it!=codings.end(); it++)
+    if (it->first == name)
+      return true;
+  return false;
+}
+
+/**********************************************************************/
+
+class GzipCoding : public ContentCoding
+{
+  public:
+    GzipCoding() : ContentCoding("gzip") {};
+
+    size_t encode(unsigned char** dst, const unsigned char* src, const size_t sizeSrc, const CompressionPolicy& policy) const
+    {
+      if (policy.getParallelMinSize() && sizeSrc >= policy.getParallelMinSize())
+        return ParallelGzip::gzip(dst, src, sizeSrc, policy.getLevel(), policy.getStrategy());
+      return nvj_gzip(dst, src, sizeSrc, false, policy.getLevel(), policy.getStrategy());
+    }
+};
+
+/**********************************************************************/
+
+class DeflateCoding : public ContentCoding
+{
+  public:
+    DeflateCoding() : ContentCoding("deflate") {};
+
+    // rfc7230: "deflate" is the zlib data format (rfc1950) around the deflate stream
+    size_t encode(unsigned char** dst, const unsigned char* src, const size_t sizeSrc, const CompressionPolicy& policy) const
+    {
+      z_stream *strm=nvj_thread_deflate_stream(true, policy.getLevel(), policy.getStrategy());
+      size_t sizeDst=deflateBound(strm, sizeSrc) + 6;
+      if ( (*dst=(unsigned char *)malloc(sizeDst)) == NULL )
+        throw std::runtime_error(std::string("deflate : malloc error") );
+
+      size_t len;
+      try
+      {
+        len=nvj_deflate_buffer(strm, *dst + 2, sizeDst - 6, src, sizeSrc);
+      }
+      catch (...)
+      {
+        free (*dst);
+        throw;
+      }
+
+      (*dst)[0]=0x78; // deflate, 32K window
+      (*dst)[1]=0x9C; // no dictionary, check bits
+      unsigned long adler=adler32(adler32(0L, Z_NULL, 0), src, sizeSrc);
+      for (int i=0; i<4; i++)
+        (*dst)[2+len+i]=(adler >> (24 - 8*i)) & 0xFF;
+
+      return len + 6;
+    }
+};
+
+/**********************************************************************/
+
+#ifdef HAVE_BROTLI
+class BrotliCoding : public ContentCoding
+{
+  public:
+    BrotliCoding() : ContentCoding("br") {};
+
+    size_t encode(unsigned char** dst, const unsigned char* src, const size_t sizeSrc, const CompressionPolicy& policy) const
+    {
+      int quality = policy.getLevel() < 0 ? 5 : policy.getLevel();
+      if (quality > BROTLI_MAX_QUALITY) quality = BROTLI_MAX_QUALITY;
+
+      size_t sizeDst=BrotliEncoderMaxCompressedSize(sizeSrc);
+      if ( !sizeDst || (*dst=(unsigned char *)malloc(sizeDst)) == NULL )
+        throw std::runtime_error(std::string("brotli : malloc error") );
+
+      if ( !BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, sizeSrc, src, &sizeDst, *dst) )
+      {
+        free (*dst);
+        throw std::runtime_error(std::string("brotli : compression error") );
+      }
+      return sizeDst;
+    }
+};
+#endif
+
+/**********************************************************************/
+
+#ifdef HAVE_ZSTD
+class ZstdCoding : public ContentCoding
+{
+  static pthread_key_t key;
+  static pthread_once_t once;
+
+  static void freeContext(void *ctx) { ZSTD_freeCCtx((ZSTD_CCtx *)ctx); };
+  static void createKey() { pthread_key_create(&key, freeContext); };
+
+  public:
+    ZstdCoding() : ContentCoding("zstd") {};
+
+    size_t encode(unsigned char** dst, const unsigned char* src, const size_t sizeSrc, const CompressionPolicy& policy) const
+    {
+      // one compression context per thread
+      pthread_once(&once, createKey);
+      ZSTD_CCtx *ctx=(ZSTD_CCtx *)pthread_getspecific(key);
+      if (ctx == NULL)
+      {
+        if ( (ctx=ZSTD_createCCtx()) == NULL )
+          throw std::runtime_error(std::string("zstd : context allocation error") );
+        pthread_setspecific(key, ctx);
+      }
+
+      int level = policy.getLevel() < 0 ? 3 : policy.getLevel();
+
+      size_t sizeDst=ZSTD_compressBound(sizeSrc);
+      if ( (*dst=(unsigned char *)malloc(sizeDst)) == NULL )
+        throw std::runtime_error(std::string("zstd : malloc error") );
+
+      size_t len=ZSTD_compressCCtx(ctx, *dst, sizeDst, src, sizeSrc, level);
+      if (ZSTD_isError(len))
+      {
+        free (*dst);
+        throw std::runtime_error(std::string("zstd : compression error - ") + ZSTD_getErrorName(len) );
+      }
+      return len;
+    }
+};
+
+pthread_key_t ZstdCoding::key;
+pthread_once_t ZstdCoding::once = PTHREAD_ONCE_INIT;
+#endif
+
+/**********************************************************************/
+
+static std::vector<ContentCoding *> defaultCodings()
+{
+  std::vector<ContentCoding *> codings;
+
+  // server preference: the densest first
+#ifdef HAVE_ZSTD
+  codings.push_back(new ZstdCoding);
+#endif
+#ifdef HAVE_BROTLI
+  codings.push_back(new BrotliCoding);
+#endif
+  codings.push_back(new GzipCoding);
+  codings.push_back(new DeflateCoding);
+
+  return codings;
+}
+
+std::vector<ContentCoding *>& ContentCoding::registry()
+{
+  static std::vector<ContentCoding *> codings=defaultCodings();
+  return codings;
+}
+
+/**********************************************************************/
+
+void ContentCoding::registerCoding(ContentCoding *coding)
+{
+  std::vector<ContentCoding *>& codings=registry();
+  for (std::vector<ContentCoding *>::iterator it=codings.begin(); it!=codings.end(); it++)
+    if ((*it)->getName() == coding->getName())
+    {
+      *it=coding;
+      return;
+    }
+  codings.push_back(coding);
+}
+
+/**********************************************************************/
+
+const ContentCoding* ContentCoding::get(const std::string& name)
+{
+  std::vector<ContentCoding *>& codings=registry();
+  for (std::vector<ContentCoding *>::const_iterator it=codings.begin(); it!=codings.end(); it++)
+    if ((*it)->getName() == name)
+      return *it;
+  return NULL;
+}
+
+/**********************************************************************/
+
+const ContentCoding* ContentCoding::negotiate(const AcceptEncoding& acceptEncoding)
+{
+  const ContentCoding *best=NULL;
+  float bestQ=0;
+
+  std::vector<ContentCoding *>& codings=registry();
+  for (std::vector<ContentCoding *>::const_iterator it=codings.begin(); it!=codings.end(); it++)
+  {
+    float q=acceptEncoding.getQValue((*it)->getName());
+    if (q > bestQ)
+    {
+      best=*it;
+      bestQ=q;
+    }
+  }
+
+  // an explicitly preferred identity
+  if (best != NULL && acceptEncoding.isListed("identity") && acceptEncoding.getQValue("identity") > bestQ)
+    return NULL;
+
+  return best;
+}
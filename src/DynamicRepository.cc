@@ -0,0 +1,302 @@
+//********************************************************
+/**
+ * @file  DynamicRepository.cc
+ *
+ * @brief Handles dynamic web repository
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "libnavajo/WebRepository.hh"
+#include "libnavajo/DynamicPage.hh"
+#include "libnavajo/DynamicRepository.hh"
+#include "libnavajo/LogRecorder.hh"
+
+
+/**********************************************************************/
+
+DynamicRepository::DynamicRepository()
+{
+  pthread_mutex_init(&_mutex, NULL);
+  treeReaders[0]=treeReaders[1]=0;
+  treeEpoch=0;
+  root=newNode();
+  createdNodes.clear();
+}
+
+/**********************************************************************/
+
+DynamicRepository::~DynamicRepository()
+{
+  deleteTree(root);
+  pthread_mutex_destroy(&_mutex);
+}
+
+/**********************************************************************/
+
+void DynamicRepository::deleteTree(RouteNode *node)
+{
+  for (size_t i=0; i<node->children.size(); i++)
+    deleteTree(node->children[i]);
+  if (node->paramChild != NULL)
+    deleteTree(node->paramChild);
+  if (node->wildcardChild != NULL)
+    deleteTree(node->wildcardChild);
+  delete node;
+}
+
+/**********************************************************************/
+/**
+* create a node, or a copy of a node (called with _mutex locked)
+*/
+DynamicRepository::RouteNode* DynamicRepository::newNode(const RouteNode *node)
+{
+  RouteNode *n=new RouteNode;
+  if (node != NULL)
+    *n=*node;
+  else
+  {
+    n->paramChild=n->wildcardChild=NULL;
+    n->paramName=NULL;
+    for (int m=0; m<=DELETE_METHOD; m++)
+      n->pages[m]=NULL;
+  }
+  createdNodes.push_back(n);
+  return n;
+}
+
+/**********************************************************************/
+/**
+* insert a route below a node, whose prefix is matched
+* @param node: the node (NULL: a new node)
+* @param pattern: the route
+* @param p: the remaining characters of the route
+* @return the copy of the node with the route, or NULL if the route names
+* a parameter differently from an existing route at the same position
+*/
+DynamicRepository::RouteNode* DynamicRepository::insert(const RouteNode *node, const char *pattern, const char *p,
+                                                        HttpRequestMethod method, DynamicPage *page)
+{
+  RouteNode *n=newNode(node);
+  if (node != NULL)
+    replacedNodes.push_back(node);
+
+  if (!*p)
+  {
+    n->pages[method]=page;
+    return n;
+  }
+
+  // parameter and wildcard segments
+  if ((p == pattern || p[-1] == '/') && (*p == ':' || *p == '*'))
+  {
+    const char *end = *p == ':' ? p + strcspn(p, "/") : p + strlen(p);
+    RouteNode *&child = *p == ':' ? n->paramChild : n->wildcardChild;
+    std::string paramName(p+1, end-p-1);
+    if (child != NULL && *child->paramName != paramName)
+      return NULL;
+    if ( (child=insert(child, pattern, end, method, page)) == NULL )
+      return NULL;
+    child->paramName=&*paramNames.insert(paramName).first;
+    return n;
+  }
+
+  size_t len=0;
+  while (p[len] && !((p[len] == ':' || p[len] == '*') && p[len-1] == '/'))
+    len++;
+
+  for (size_t i=0; i<n->children.size(); i++)
+  {
+    RouteNode *child=n->children[i];
+    if (child->prefix[0] != *p)
+      continue;
+
+    size_t common=0;
+    while (common < len && common < child->prefix.size() && child->prefix[common] == p[common])
+      common++;
+
+    // split the child on the common prefix
+    if (common < child->prefix.size())
+    {
+      replacedNodes.push_back(child);
+      RouteNode *tail=newNode(child);
+      tail->prefix.erase(0, common);
+      child=newNode();
+      child->prefix.assign(p, common);
+      child->children.push_back(tail);
+    }
+
+    if ( (n->children[i]=insert(child, pattern, p+common, method, page)) == NULL )
+      return NULL;
+    return n;
+  }
+
+  RouteNode *child=newNode();
+  child->prefix.assign(p, len);
+  if ( (child=insert(child, pattern, p+len, method, page)) == NULL )
+    return NULL;
+  n->children.push_back(child);
+  return n;
+}
+
+/**********************************************************************/
+
+void DynamicRepository::add(HttpRequestMethod method, const std::string& url, DynamicPage *page)
+{
+  size_t i=0;
+  while (i < url.size() && url[i]=='/') i++;
+  const char *pattern=url.c_str()+i;
+
+  pthread_mutex_lock( &_mutex );
+  RouteNode *newRoot=insert(root, pattern, pattern, method, page);
+  if (newRoot != NULL)
+  {
+    __atomic_store_n(&root, newRoot, __ATOMIC_SEQ_CST);
+
+    // a reader may have read the epoch before a flip and counted itself
+    // after: wait for the readers of one parity, then of the other one
+    for (int i=0; i<2; i++)
+    {
+      unsigned parity=__atomic_fetch_add(&treeEpoch, 1, __ATOMIC_SEQ_CST) & 1;
+      while (__atomic_load_n(&treeReaders[parity], __ATOMIC_ACQUIRE))
+        sched_yield();
+    }
+    for (size_t i=0; i<replacedNodes.size(); i++)
+      delete replacedNodes[i];
+  }
+  else
+    // the copies were never published
+    for (size_t i=0; i<createdNodes.size(); i++)
+      delete createdNodes[i];
+  createdNodes.clear();
+  replacedNodes.clear();
+  pthread_mutex_unlock( &_mutex );
+
+  if (newRoot == NULL)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "DynamicRepository - route '" + url + "' ignored: a parameter is named differently by another route");
+    return;
+  }
+
+  routesChanged();
+}
+
+/**********************************************************************/
+/**
+* find the page of an url below a node, whose prefix is matched: the static
+* children first, then the parameter, then the wildcard
+* @param node: the node
+* @param url: the url
+* @param path: the remaining characters of the url
+* @param request: the request, which receives the parameters values
+* @return the page, or NULL
+*/
+DynamicPage* DynamicRepository::lookup(const RouteNode *node, const char *url, const char *path, HttpRequest* request)
+{
+  HttpRequestMethod method=request->getRequestType();
+  DynamicPage *page;
+
+  if (!*path)
+  {
+    if ( (page=getPage(node, method)) != NULL )
+      return page;
+  }
+  else
+    for (size_t i=0; i<node->children.size(); i++)
+    {
+      const std::string& prefix=node->children[i]->prefix;
+      if (prefix[0] != *path)
+        continue;
+      if (!strncmp(path, prefix.c_str(), prefix.size())
+          && (page=lookup(node->children[i], url, path+prefix.size(), request)) != NULL)
+        return page;
+      break;
+    }
+
+  if (path != url && path[-1] != '/')
+    return NULL;
+
+  unsigned nbParameters=request->nbUrlParameters;
+  if (nbParameters == URL_PARAMETERS_MAX)
+    return NULL;
+  HttpRequest::UrlParameter& parameter=request->urlParameters[nbParameters];
+
+  if (node->paramChild != NULL && *path && *path != '/')
+  {
+    const char *end=path + strcspn(path, "/");
+    parameter.name=node->paramChild->paramName->c_str();
+    parameter.nameLength=node->paramChild->paramName->size();
+    parameter.value=path;
+    parameter.valueLength=end-path;
+    request->nbUrlParameters=nbParameters+1;
+    if ( (page=lookup(node->paramChild, url, end, request)) != NULL )
+      return page;
+    request->nbUrlParameters=nbParameters;
+  }
+
+  if (node->wildcardChild != NULL && (page=getPage(node->wildcardChild, method)) != NULL)
+  {
+    parameter.name=node->wildcardChild->paramName->c_str();
+    parameter.nameLength=node->wildcardChild->paramName->size();
+    parameter.value=path;
+    parameter.valueLength=strlen(path);
+    request->nbUrlParameters=nbParameters+1;
+    return page;
+  }
+
+  return NULL;
+}
+
+/**********************************************************************/
+
+bool DynamicRepository::getFile(HttpRequest* request, HttpResponse *response)
+{
+  const char *url = request->getUrl();
+  while (*url == '/') url++;
+
+  request->nbUrlParameters=0;
+  unsigned parity=__atomic_load_n(&treeEpoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_add_fetch(&treeReaders[parity], 1, __ATOMIC_SEQ_CST);
+  DynamicPage *page=lookup(__atomic_load_n(&root, __ATOMIC_SEQ_CST), url, url, request);
+  __atomic_sub_fetch(&treeReaders[parity], 1, __ATOMIC_RELEASE);
+  if (page == NULL)
+    return false;
+
+  bool res = page->getPage( request, response );
+  if (request->getSessionId().size())
+    response->addSessionCookie(request->getSessionId());
+  return res;
+}
+
+/**********************************************************************/
+
+void DynamicRepository::getRoutes(const RouteNode *node, const std::string& url, std::vector<WebRoute>& routes)
+{
+  for (int m=0; m<=DELETE_METHOD; m++)
+    if (node->pages[m] != NULL)
+    {
+      routes.push_back(WebRoute(url, false));
+      break;
+    }
+
+  if (node->paramChild != NULL || node->wildcardChild != NULL)
+    routes.push_back(WebRoute(url, true));
+
+  for (size_t i=0; i<node->children.size(); i++)
+    getRoutes(node->children[i], url + node->children[i]->prefix, routes);
+}
+
+/**********************************************************************/
+
+void DynamicRepository::getRoutes(std::vector<WebRoute>& routes)
+{
+  unsigned parity=__atomic_load_n(&treeEpoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_add_fetch(&treeReaders[parity], 1, __ATOMIC_SEQ_CST);
+  getRoutes(__atomic_load_n(&root, __ATOMIC_SEQ_CST), "", routes);
+  __atomic_sub_fetch(&treeReaders[parity], 1, __ATOMIC_RELEASE);
+}
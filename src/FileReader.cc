@@ -0,0 +1,34 @@
+//********************************************************
+/**
+ * @file  FileReader.cc
+ *
+ * @brief Reads the files served
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "libnavajo/FileReader.hh"
+
+
+/**********************************************************************/
+
+ssize_t FileReader::read(int fd, unsigned char *buffer, size_t length, off_t offset)
+{
+  size_t done=0;
+  while (done < length)
+  {
+    ssize_t n=::pread(fd, buffer + done, length - done, offset + done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return -1;
+    if (n == 0)
+      break;
+    done+=n;
+  }
+  return done;
+}
@@ -0,0 +1,505 @@
+//****************************************************************************
+/**
+ * @file  HttpSession.cc
+ *
+ * @brief The Http Sessions Manager class
+ *
+ * @version 1
+ */
+//****************************************************************************
+
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <algorithm>
+#ifdef LINUX
+#include <sys/syscall.h>
+#endif
+
+#include "libnavajo/HttpSession.hh"
+#include "libnavajo/LogRecorder.hh"
+
+#define RANDOM_BUFFER_SIZE 4096
+
+
+HttpSession::Shard *HttpSession::shards=new HttpSession::Shard[HTTPSESSION_SHARDS];
+time_t HttpSession::sessionLifeTime=20*60;
+size_t HttpSession::sessionIdLength=128;
+pthread_once_t HttpSession::expirationThreadOnce=PTHREAD_ONCE_INIT;
+
+// the random bytes of a thread, drawn from the kernel by blocks
+struct RandomBuffer
+{
+  unsigned char data[RANDOM_BUFFER_SIZE];
+  size_t pos;
+  unsigned generation;
+};
+
+static pthread_key_t randomKey;
+static pthread_once_t randomOnce=PTHREAD_ONCE_INIT;
+static volatile unsigned forkGeneration=0; // the buffers copied by fork are discarded
+
+static void forkChild()
+{
+  forkGeneration++;
+}
+
+static void createRandomKey()
+{
+  pthread_key_create(&randomKey, free);
+  pthread_atfork(NULL, NULL, forkChild);
+}
+
+/**********************************************************************/
+/**
+* fill a buffer from the kernel CSPRNG: getrandom, or /dev/urandom
+* @return false if no random source is available
+*/
+static bool getRandomBytes(unsigned char *buffer, size_t length)
+{
+  size_t done=0;
+#ifdef SYS_getrandom
+  while (done < length)
+  {
+    long n=syscall(SYS_getrandom, buffer + done, length - done, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      break;
+    done+=n;
+  }
+  if (done == length)
+    return true;
+#endif
+
+  int fd=open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  while (done < length)
+  {
+    ssize_t n=read(fd, buffer + done, length - done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done+=n;
+  }
+  close(fd);
+  return done == length;
+}
+
+/**********************************************************************/
+/**
+* build a random session id, from the random buffer of the thread
+* @param id: set to sessionIdLength characters of [a-zA-Z0-9]
+*/
+void HttpSession::generateId(std::string& id)
+{
+  static const char elements[] = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  const unsigned nbElements = sizeof(elements) - 1;
+  const unsigned limit = 256 - 256 % nbElements; // the greater bytes are rejected (uniformity)
+
+  pthread_once(&randomOnce, createRandomKey);
+  RandomBuffer *random=(RandomBuffer *)pthread_getspecific(randomKey);
+  if (random == NULL)
+  {
+    random=(RandomBuffer *)malloc(sizeof(RandomBuffer));
+    random->pos=RANDOM_BUFFER_SIZE;
+    pthread_setspecific(randomKey, random);
+  }
+  if (random->generation != forkGeneration)
+  {
+    random->pos=RANDOM_BUFFER_SIZE;
+    random->generation=forkGeneration;
+  }
+
+  size_t length=sessionIdLength;
+  id.resize(length);
+  for (size_t i=0; i<length; )
+  {
+    if (random->pos == RANDOM_BUFFER_SIZE)
+    {
+      if (!getRandomBytes(random->data, RANDOM_BUFFER_SIZE))
+      {
+        NVJ_LOG->append(NVJ_FATAL, std::string("HttpSession - no random source: ")+strerror(errno));
+        ::exit(1);
+      }
+      random->pos=0;
+    }
+    unsigned char byte=random->data[random->pos++];
+    if (byte < limit)
+      id[i++]=elements[byte % nbElements];
+  }
+}
+
+/**********************************************************************/
+
+void HttpSession::create(std::string& id)
+{
+  pthread_once(&expirationThreadOnce, startExpirationThread);
+
+  Session *session=new Session;
+  session->expiration=time(NULL)+sessionLifeTime;
+  session->scheduled=false;
+
+  bool inserted=false;
+  do
+  {
+    generateId(id);
+
+    Shard& shard=getShard(id);
+    pthread_rwlock_wrlock( &shard.lock );
+    inserted=shard.sessions.insert(HttpSessionsContainerMap::value_type(id, session)).second;
+    if (inserted)
+      schedule(shard, id, session);
+    pthread_rwlock_unlock( &shard.lock );
+  }
+  while (!inserted);
+}
+
+/**********************************************************************/
+/**
+* add the expiration of a session to the heap (under the write lock)
+*/
+void HttpSession::schedule(Shard& shard, const std::string& id, Session *session)
+{
+  shard.expirations.push_back(Expiration(session->expiration, session, id));
+  std::push_heap(shard.expirations.begin(), shard.expirations.end());
+  session->scheduled=true;
+}
+
+/**********************************************************************/
+/**
+* schedule again a session whose expiration was removed from the heap by
+* noExpiration, once it has an expiration time
+*/
+void HttpSession::reschedule(Shard& shard, const std::string& id)
+{
+  pthread_rwlock_wrlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(id);
+  if (it != shard.sessions.end() && !it->second->scheduled && it->second->expiration)
+    schedule(shard, id, it->second);
+  pthread_rwlock_unlock( &shard.lock );
+}
+
+/**********************************************************************/
+
+void HttpSession::updateExpiration(const std::string& id)
+{
+  Shard& shard=getShard(id);
+  pthread_rwlock_rdlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(id);
+  bool scheduled=true;
+  if (it != shard.sessions.end())
+  {
+    __atomic_store_n(&it->second->expiration, time(NULL)+sessionLifeTime, __ATOMIC_RELAXED);
+    scheduled=it->second->scheduled;
+  }
+  pthread_rwlock_unlock( &shard.lock );
+
+  if (!scheduled)
+    reschedule(shard, id);
+}
+
+/**********************************************************************/
+
+void HttpSession::noExpiration(const std::string& id)
+{
+  Shard& shard=getShard(id);
+  pthread_rwlock_rdlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(id);
+  if (it != shard.sessions.end())
+    __atomic_store_n(&it->second->expiration, 0, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock( &shard.lock );
+}
+
+/**********************************************************************/
+
+void HttpSession::removeExpiredSession()
+{
+  for (size_t i=0; i<HTTPSESSION_SHARDS; i++)
+    while (removeExpiredSession(shards[i], time(NULL)))
+      ;
+}
+
+/**********************************************************************/
+/**
+* process the reached expirations of a shard, by batch to not hold the
+* lock for long
+* @return true if some expirations remain to be processed
+*/
+bool HttpSession::removeExpiredSession(Shard& shard, time_t now)
+{
+  std::vector<Expiration>& heap=shard.expirations;
+  pthread_rwlock_wrlock( &shard.lock );
+  for (size_t n=0; n < HTTPSESSION_EXPIRATION_BATCH; n++)
+  {
+    if (heap.empty() || heap.front().time > now)
+    {
+      pthread_rwlock_unlock( &shard.lock );
+      return false;
+    }
+
+    Expiration expiration=heap.front();
+    std::pop_heap(heap.begin(), heap.end());
+    heap.pop_back();
+
+    // the session may have been removed, or used since
+    HttpSessionsContainerMap::iterator it = shard.sessions.find(expiration.id);
+    if (it == shard.sessions.end() || it->second != expiration.session)
+      continue;
+    Session *session=it->second;
+    time_t expires=__atomic_load_n(&session->expiration, __ATOMIC_RELAXED);
+    if (!expires)
+      session->scheduled=false;
+    else
+      if (expires > now)
+      {
+        expiration.time=expires;
+        heap.push_back(expiration);
+        std::push_heap(heap.begin(), heap.end());
+      }
+      else
+      {
+        removeAllAttribute(session->attributes);
+        delete session;
+        shard.sessions.erase(it);
+      }
+  }
+  pthread_rwlock_unlock( &shard.lock );
+  return true;
+}
+
+/**********************************************************************/
+
+void HttpSession::startExpirationThread()
+{
+  pthread_t thread;
+  create_thread(&thread, expirationThread, NULL);
+  pthread_detach(thread);
+}
+
+/**********************************************************************/
+
+void* HttpSession::expirationThread(void *)
+{
+  for (;;)
+  {
+    sleep(1);
+    for (size_t i=0; i<HTTPSESSION_SHARDS; i++)
+      while (removeExpiredSession(shards[i], time(NULL)))
+        sched_yield();
+  }
+  return NULL;
+}
+
+/**********************************************************************/
+
+void HttpSession::removeAllSession()
+{
+  for (size_t i=0; i<HTTPSESSION_SHARDS; i++)
+  {
+    Shard& shard=shards[i];
+    pthread_rwlock_wrlock( &shard.lock );
+    HttpSessionsContainerMap::iterator it = shard.sessions.begin();
+    for (;it != shard.sessions.end(); )
+    {
+      removeAllAttribute(it->second->attributes);
+      delete it->second;
+      shard.sessions.erase(it++);
+    }
+    shard.expirations.clear();
+    pthread_rwlock_unlock( &shard.lock );
+  }
+}
+
+/**********************************************************************/
+
+bool HttpSession::find(const std::string& id)
+{
+  Shard& shard=getShard(id);
+  bool res=false, scheduled=true;
+  pthread_rwlock_rdlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(id);
+  if (it != shard.sessions.end())
+  {
+    time_t now=time(NULL), expiration=__atomic_load_n(&it->second->expiration, __ATOMIC_RELAXED);
+    res=!expiration || expiration > now;
+    if (res)
+    {
+      __atomic_store_n(&it->second->expiration, now+sessionLifeTime, __ATOMIC_RELAXED);
+      scheduled=it->second->scheduled;
+    }
+  }
+  pthread_rwlock_unlock( &shard.lock );
+
+  if (!scheduled)
+    reschedule(shard, id);
+  return res;
+}
+
+/**********************************************************************/
+
+void HttpSession::remove(const std::string& sid)
+{
+  Shard& shard=getShard(sid);
+  pthread_rwlock_wrlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(sid);
+  if (it != shard.sessions.end())
+  {
+    removeAllAttribute(it->second->attributes);
+    delete it->second;
+    shard.sessions.erase(it);
+  }
+  pthread_rwlock_unlock( &shard.lock );
+}
+
+/**********************************************************************/
+
+void HttpSession::setSessionAttribute(const std::string &sid, const std::string &name, const SessionAttribute& attribute)
+{
+  Shard& shard=getShard(sid);
+  pthread_rwlock_wrlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(sid);
+  if (it != shard.sessions.end())
+    it->second->attributes.insert(std::pair<std::string, SessionAttribute>(name, attribute ));
+  pthread_rwlock_unlock( &shard.lock );
+}
+
+/**********************************************************************/
+
+void HttpSession::setObjectAttribute ( const std::string &sid, const std::string &name, SessionAttributeObject *sessionAttributeObject )
+{
+  SessionAttribute attribute;
+  attribute.type=SessionAttribute::OBJECT;
+  attribute.obj=sessionAttributeObject;
+  setSessionAttribute(sid, name, attribute);
+}
+
+/**********************************************************************/
+
+void HttpSession::setAttribute ( const std::string &sid, const std::string &name, void* value )
+{
+  SessionAttribute attribute;
+  attribute.type=SessionAttribute::BASIC;
+  attribute.ptr=value;
+  setSessionAttribute(sid, name, attribute);
+}
+
+/**********************************************************************/
+
+bool HttpSession::getSessionAttribute(const std::string &sid, const std::string &name, SessionAttribute& attribute)
+{
+  Shard& shard=getShard(sid);
+  bool found=false;
+  pthread_rwlock_rdlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(sid);
+  if (it != shard.sessions.end())
+  {
+    SessionAttributes::const_iterator it2 = it->second->attributes.find(name);
+    if ( (found=it2 != it->second->attributes.end()) )
+      attribute=it2->second;
+  }
+  pthread_rwlock_unlock( &shard.lock );
+  return found;
+}
+
+/**********************************************************************/
+
+SessionAttributeObject *HttpSession::getObjectAttribute( const std::string &sid, const std::string &name )
+{
+  SessionAttribute attribute;
+  if ( getSessionAttribute(sid, name, attribute) && (attribute.type == SessionAttribute::OBJECT) )
+    return attribute.obj;
+  return NULL;
+}
+
+/**********************************************************************/
+
+void *HttpSession::getAttribute( const std::string &sid, const std::string &name )
+{
+  SessionAttribute attribute;
+  if ( getSessionAttribute(sid, name, attribute) && (attribute.type == SessionAttribute::BASIC) )
+    return attribute.ptr;
+  return NULL;
+}
+
+/**********************************************************************/
+
+void HttpSession::freeAttribute(SessionAttribute& attribute)
+{
+  if (attribute.ptr != NULL)
+  {
+    if (attribute.type==SessionAttribute::OBJECT)
+      delete attribute.obj;
+    else
+      free (attribute.ptr);
+  }
+}
+
+/**********************************************************************/
+
+void HttpSession::removeAllAttribute(SessionAttributes& attributes)
+{
+  SessionAttributes::iterator iter = attributes.begin();
+  for(; iter!=attributes.end(); ++iter)
+    freeAttribute(iter->second);
+}
+
+/**********************************************************************/
+
+void HttpSession::removeAttribute( const std::string &sid, const std::string &name )
+{
+  Shard& shard=getShard(sid);
+  pthread_rwlock_wrlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(sid);
+  if (it != shard.sessions.end())
+  {
+    SessionAttributes::iterator it2 = it->second->attributes.find(name);
+    if ( it2 != it->second->attributes.end() )
+    {
+      freeAttribute(it2->second);
+      it->second->attributes.erase(it2);
+    }
+  }
+  pthread_rwlock_unlock( &shard.lock );
+}
+
+/**********************************************************************/
+
+std::vector<std::string> HttpSession::getAttributeNames( const std::string &sid )
+{
+  std::vector<std::string> res;
+  Shard& shard=getShard(sid);
+  pthread_rwlock_rdlock( &shard.lock );
+  HttpSessionsContainerMap::iterator it = shard.sessions.find(sid);
+  if (it != shard.sessions.end())
+  {
+    SessionAttributes::const_iterator iter = it->second->attributes.begin();
+    for(; iter!=it->second->attributes.end(); ++iter)
+      res.push_back(iter->first);
+  }
+  pthread_rwlock_unlock( &shard.lock );
+  return res;
+}
+
+/**********************************************************************/
+
+void HttpSession::printAll()
+{
+  for (size_t i=0; i<HTTPSESSION_SHARDS; i++)
+  {
+    Shard& shard=shards[i];
+    pthread_rwlock_rdlock( &shard.lock );
+    HttpSessionsContainerMap::iterator it = shard.sessions.begin();
+    for (;it != shard.sessions.end(); ++it )
+    {
+      printf("Session SID : '%s' \n", it->first.c_str());
+      SessionAttributes::const_iterator iter = it->second->attributes.begin();
+      for(; iter!=it->second->attributes.end(); ++iter)
+        if ( iter->second.ptr != NULL ) printf("\t'%s'\n", iter->first.c_str());
+    }
+    pthread_rwlock_unlock( &shard.lock );
+  }
+}
@@ -14,13 +14,24 @@
 
 #include <stdlib.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sched.h>
 #include <sys/stat.h>
 #include <string.h>
+#ifdef LINUX
+#include <sys/inotify.h>
+#endif
 #include <fstream>
 #include <streambuf>
 #include <sstream>
+#include <vector>
 #include "libnavajo/LogRecorder.hh"
 #include "libnavajo/LocalRepository.hh"
+#include "libnavajo/MimeTypes.hh"
+#include "libnavajo/FileReader.hh"
 
 
 /**********************************************************************/
@@ -30,6 +41,19 @@ LocalRepository::LocalRepository(const std::string& alias, const std::string& di
   char resolved_path[4096];
 
   pthread_mutex_init(&_mutex, NULL); 
+  pthread_mutex_init(&cacheMutex, NULL);
+  pthread_mutex_init(&fdCacheMutex, NULL);
+  fingerprinting=false;
+  precompressed=true;
+  cacheMaxSize=cacheSize=0;
+  fdCacheMaxSize=0;
+  fdCacheValidity=1;
+  cacheHits=cacheMisses=0;
+  watching=false;
+  watchFd=-1;
+  indexReaders[0]=indexReaders[1]=0;
+  indexEpoch=0;
+  indexChanged=false;
 
   aliasName=alias;
   while (aliasName.size() && aliasName[0]=='/') aliasName.erase(0, 1);
@@ -38,127 +62,1171 @@ LocalRepository::LocalRepository(const std::string& alias, const std::string& di
   if (realpath(dirPath.c_str(), resolved_path) != NULL)
   {
     fullPathToLocalDir=resolved_path;
-    loadFilename_dir(aliasName, fullPathToLocalDir);
+    loadFilename_dir(filenames, aliasName, fullPathToLocalDir);
   }
+  index=new FileIndex(filenames);
+}
+
+/**********************************************************************/
+
+LocalRepository::~LocalRepository()
+{
+  setWatching(false);
+  clearCache();
+  clearOpenFileCache();
+  delete index;
+  pthread_mutex_destroy(&fdCacheMutex);
+  pthread_mutex_destroy(&cacheMutex);
+  pthread_mutex_destroy(&_mutex);
 }
 
 /**********************************************************************/
 
 void LocalRepository::reload()
 {
+  // the new index is loaded without blocking the requests
+  std::map< std::string, const char* > files;
+  loadFilename_dir(files, aliasName, fullPathToLocalDir);
+
   pthread_mutex_lock( &_mutex);
-  filenamesSet.clear();
-  loadFilename_dir(aliasName, fullPathToLocalDir);
+  filenames.swap(files);
+  fingerprints.clear();
+  indexChanged=true;
+  publishIndex();
   pthread_mutex_unlock( &_mutex);
+  clearCache();
 }
 
 /**********************************************************************/
 
-bool LocalRepository::loadFilename_dir (const std::string& alias, const std::string& path, const std::string& subpath)
+// a parallel scan of a directory tree: the threads read the directories
+// through descriptors (openat, fstatat), and share the subdirectories
+// while some threads are waiting for work
+struct DirectoryScan
 {
-    struct dirent *entry;
-    DIR *dir;
-    struct stat s;
-    std::string fullPath=path+subpath;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::vector< std::pair<int, std::string> > dirs; // directory descriptor | url prefix
+  unsigned nbThreads, nbBusy;
+};
 
-    dir = opendir (fullPath.c_str());
-    if (dir == NULL) return false;
-    while ((entry = readdir (dir)) != NULL ) 
-    {
-      if (!strcmp(entry->d_name,".") || !strcmp(entry->d_name,"..") || !strlen(entry->d_name)) continue;
+struct DirectoryScanThread
+{
+  DirectoryScan *scan;
+  std::vector< std::pair<std::string, const char*> > files; // url | mime type
+};
+
+static void scanDirectory(DirectoryScanThread& t, int fd, const std::string& prefix)
+{
+  DIR *dir=fdopendir(fd);
+  if (dir == NULL)
+  {
+    close(fd);
+    return;
+  }
 
-      std::string filepath=fullPath+'/'+entry->d_name;
+  struct dirent *entry;
+  while ((entry = readdir (dir)) != NULL)
+  {
+    const char *name=entry->d_name;
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+      continue;
 
-      if (stat(filepath.c_str(), &s) == -1) 
+    unsigned char type=entry->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK)
+    {
+      struct stat s;
+      if (fstatat(dirfd(dir), name, &s, 0) == -1)
       {
         NVJ_LOG->append(NVJ_ERROR,std::string("LocalRepository - stat error : ")+std::string(strerror(errno)));
         continue;
       }
+      type = S_ISREG(s.st_mode) ? DT_REG : S_ISDIR(s.st_mode) ? DT_DIR : DT_UNKNOWN;
+    }
+
+    if (type == DT_REG)
+      t.files.push_back(std::make_pair(prefix+name, MimeTypes::get(name)));
+
+    if (type == DT_DIR)
+    {
+      int subFd=openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (subFd == -1)
+        continue;
 
-      int type=s.st_mode & S_IFMT;
-      if (type == S_IFREG || type == S_IFLNK)
+      // given to an idle thread, or scanned now
+      DirectoryScan *scan=t.scan;
+      pthread_mutex_lock( &scan->mutex );
+      bool shared=scan->dirs.size() < scan->nbThreads - scan->nbBusy;
+      if (shared)
       {
-        std::string filename=alias+subpath+"/"+entry->d_name;
-        while (filename.size() && filename[0]=='/')
-          filename.erase(0, 1);
-        filenamesSet.insert(filename);
+        scan->dirs.push_back(std::make_pair(subFd, prefix+name+'/'));
+        pthread_cond_signal( &scan->cond );
       }
+      pthread_mutex_unlock( &scan->mutex );
+      if (!shared)
+        scanDirectory(t, subFd, prefix+name+'/');
+    }
+  }
+
+  closedir (dir);
+}
+
+static void* scanThread(void *p)
+{
+  DirectoryScanThread& t=*(DirectoryScanThread *)p;
+  DirectoryScan *scan=t.scan;
 
-      if (type == S_IFDIR)
-        loadFilename_dir(alias, path, subpath+"/"+entry->d_name);
+  pthread_mutex_lock( &scan->mutex );
+  for (;;)
+  {
+    while (scan->dirs.empty() && scan->nbBusy)
+      pthread_cond_wait( &scan->cond, &scan->mutex );
+    if (scan->dirs.empty())
+      break;
+
+    std::pair<int, std::string> dir=scan->dirs.back();
+    scan->dirs.pop_back();
+    scan->nbBusy++;
+    pthread_mutex_unlock( &scan->mutex );
+
+    scanDirectory(t, dir.first, dir.second);
+
+    pthread_mutex_lock( &scan->mutex );
+    if (!--scan->nbBusy && scan->dirs.empty())
+      pthread_cond_broadcast( &scan->cond );
+  }
+  pthread_mutex_unlock( &scan->mutex );
+
+  return NULL;
+}
+
+/**********************************************************************/
+/**
+* load the files of a directory tree
+* @param files: the map to complete (url | mime type)
+* @param alias: the url prefix
+* @param path: the local directory
+* @param subpath: the subdirectory to load (ex: "/js")
+* @return false if the directory can't be opened
+*/
+bool LocalRepository::loadFilename_dir (std::map< std::string, const char* >& files, const std::string& alias, const std::string& path, const std::string& subpath)
+{
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  int fd=open((path+subpath).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  std::string prefix=alias+subpath+'/';
+  while (prefix.size() && prefix[0]=='/')
+    prefix.erase(0, 1);
+
+  DirectoryScan scan;
+  pthread_mutex_init(&scan.mutex, NULL);
+  pthread_cond_init(&scan.cond, NULL);
+  long nbCpus=sysconf(_SC_NPROCESSORS_ONLN);
+  scan.nbThreads = nbCpus < 1 ? 1 : nbCpus > 16 ? 16 : nbCpus;
+  scan.nbBusy=0;
+  scan.dirs.push_back(std::make_pair(fd, prefix));
+
+  std::vector<DirectoryScanThread> threads(scan.nbThreads);
+  std::vector<pthread_t> threadIds(scan.nbThreads);
+  for (unsigned i=0; i<scan.nbThreads; i++)
+  {
+    threads[i].scan=&scan;
+    create_thread(&threadIds[i], scanThread, &threads[i]);
+  }
+
+  size_t nbFiles=0;
+  for (unsigned i=0; i<scan.nbThreads; i++)
+  {
+    wait_for_thread(threadIds[i]);
+    files.insert(threads[i].files.begin(), threads[i].files.end());
+    nbFiles+=threads[i].files.size();
+  }
+
+  pthread_cond_destroy(&scan.cond);
+  pthread_mutex_destroy(&scan.mutex);
+
+  if (subpath.empty())
+  {
+    gettimeofday(&end, NULL);
+    char logBuffer[300];
+    snprintf(logBuffer, sizeof logBuffer, "LocalRepository - '%s' : %lu files scanned in %ld ms",
+             (path+subpath).c_str(), (unsigned long)nbFiles,
+             (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000));
+    NVJ_LOG->append(NVJ_INFO, logBuffer);
+  }
+
+  return true;
+}
+
+/**********************************************************************/
+
+static inline uint32_t urlHash(const std::string& url)
+{
+  // FNV-1a
+  uint32_t h=2166136261u;
+  for (size_t i=0; i<url.size(); i++)
+    h = (h ^ (unsigned char)url[i]) * 16777619u;
+  return h;
+}
+
+/**********************************************************************/
+
+LocalRepository::FileIndex::FileIndex(const std::map< std::string, const char* >& files)
+{
+  size_t size=16;
+  while (size < 2 * files.size())
+    size*=2;
+  slots.resize(size, 0);
+  urls.reserve(files.size());
+  mimeTypes.reserve(files.size());
+
+  for (std::map< std::string, const char* >::const_iterator it=files.begin(); it!=files.end(); it++)
+  {
+    size_t i=urlHash(it->first) & (size-1);
+    while (slots[i])
+      i=(i+1) & (size-1);
+    urls.push_back(it->first);
+    mimeTypes.push_back(it->second);
+    slots[i]=urls.size();
+  }
+}
+
+/**********************************************************************/
+
+bool LocalRepository::FileIndex::find(const std::string& url, const char **mimeType) const
+{
+  size_t mask=slots.size()-1;
+  for (size_t i=urlHash(url) & mask; slots[i]; i=(i+1) & mask)
+    if (urls[slots[i]-1] == url)
+    {
+      if (mimeType != NULL)
+        *mimeType=mimeTypes[slots[i]-1];
+      return true;
     }
+  return false;
+}
+
+/**********************************************************************/
+/**
+* look for a file in the index, without lock
+* @param url: the url
+* @param mimeType: set to the mime type of the file (NULL: unknown)
+*/
+bool LocalRepository::fileExist(const std::string& url, const char **mimeType)
+{
+  unsigned parity=__atomic_load_n(&indexEpoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_add_fetch(&indexReaders[parity], 1, __ATOMIC_SEQ_CST);
+  bool found=__atomic_load_n(&index, __ATOMIC_SEQ_CST)->find(url, mimeType);
+  __atomic_sub_fetch(&indexReaders[parity], 1, __ATOMIC_RELEASE);
+  return found;
+}
 
-    closedir (dir);
+/**********************************************************************/
+/**
+* replace the index by a copy of the filenames, if they have changed
+* (called with _mutex locked)
+*/
+void LocalRepository::publishIndex()
+{
+  if (!indexChanged)
+    return;
+  indexChanged=false;
 
-    return true;
+  FileIndex *previous=index;
+  __atomic_store_n(&index, new FileIndex(filenames), __ATOMIC_SEQ_CST);
+
+  // a reader may have read the epoch before a flip and counted itself
+  // after: wait for the readers of one parity, then of the other one
+  for (int i=0; i<2; i++)
+  {
+    unsigned parity=__atomic_fetch_add(&indexEpoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&indexReaders[parity], __ATOMIC_ACQUIRE))
+      sched_yield();
+  }
+  delete previous;
 }
 
 /**********************************************************************/
 
-bool LocalRepository::fileExist(const std::string& url)
+std::set< std::string > LocalRepository::getFilenames()
 {
-  return filenamesSet.find(url) != filenamesSet.end();
+  std::set< std::string > names;
+  pthread_mutex_lock( &_mutex );
+  for (std::map< std::string, const char* >::const_iterator it = filenames.begin(); it != filenames.end(); it++)
+    names.insert(names.end(), it->first);
+  pthread_mutex_unlock( &_mutex );
+  return names;
 }
 
 /**********************************************************************/
 
 void LocalRepository::printFilenames()
 {
-  for (std::set<std::string>::iterator it = filenamesSet.begin(); it != filenamesSet.end(); it++)
-    printf ("%s\n", it->c_str() );
+  pthread_mutex_lock( &_mutex );
+  for (std::map< std::string, const char* >::const_iterator it = filenames.begin(); it != filenames.end(); it++)
+    printf ("%s\n", it->first.c_str() );
+  pthread_mutex_unlock( &_mutex );
 }
 
 /**********************************************************************/
+/**
+* the url of a file or directory
+* @param subpath: its path in the local directory (ex: "/js/app.js")
+*/
+std::string LocalRepository::getUrl(const std::string& subpath)
+{
+  std::string url=aliasName+subpath;
+  while (url.size() && url[0]=='/')
+    url.erase(0, 1);
+  return url;
+}
 
-bool LocalRepository::getFile(HttpRequest* request, HttpResponse *response)
+/**********************************************************************/
+/**
+* remove a file from the caches and the fingerprints
+*/
+void LocalRepository::invalidate(const std::string& url)
 {
-  std::string url = request->getUrl();
-  size_t webpageLen;
-  unsigned char *webpage;
   pthread_mutex_lock( &_mutex );
+  fingerprints.erase(url);
+  pthread_mutex_unlock( &_mutex );
 
-  if ( url.compare(0, aliasName.size(), aliasName) || !fileExist(url) )
-    { pthread_mutex_unlock( &_mutex); return false; };
-    
-  pthread_mutex_unlock( &_mutex);
+  pthread_mutex_lock( &cacheMutex );
+  std::map< std::string, CachedFile >::iterator it=cache.find(url);
+  if (it != cache.end())
+    removeCachedFile(it);
+  pthread_mutex_unlock( &cacheMutex );
+
+  pthread_mutex_lock( &fdCacheMutex );
+  std::map< std::string, OpenFile* >::iterator fit=fdCache.find(url);
+  if (fit != fdCache.end())
+    removeOpenFile(fit);
+  pthread_mutex_unlock( &fdCacheMutex );
+}
+
+/**********************************************************************/
+/**
+* add the files of a new directory to the index
+* @param subpath: the path of the directory in the local directory
+*/
+void LocalRepository::addFiles(const std::string& subpath)
+{
+  std::map< std::string, const char* > files;
+  loadFilename_dir(files, aliasName, fullPathToLocalDir, subpath);
+
+  pthread_mutex_lock( &_mutex );
+  filenames.insert(files.begin(), files.end());
+  indexChanged=true;
+  pthread_mutex_unlock( &_mutex );
+
+  for (std::map< std::string, const char* >::const_iterator it=files.begin(); it!=files.end(); it++)
+    invalidate(it->first);
+}
+
+/**********************************************************************/
+/**
+* remove a file, or the files of a directory, from the index
+*/
+void LocalRepository::removeFiles(const std::string& url)
+{
+  std::vector< std::string > removed;
+  std::string prefix=url+'/';
+
+  pthread_mutex_lock( &_mutex );
+  if (filenames.erase(url))
+    removed.push_back(url);
+  std::map< std::string, const char* >::iterator it=filenames.lower_bound(prefix);
+  while (it != filenames.end() && !it->first.compare(0, prefix.size(), prefix))
+  {
+    removed.push_back(it->first);
+    filenames.erase(it++);
+  }
+  indexChanged|=!removed.empty();
+  pthread_mutex_unlock( &_mutex );
 
-  std::string resultat, filename=url;
+  for (size_t i=0; i<removed.size(); i++)
+    invalidate(removed[i]);
+}
+
+/**********************************************************************/
+
+bool LocalRepository::setWatching(bool b)
+{
+#ifdef LINUX
+  if (b == watching)
+    return true;
+
+  if (!b)
+  {
+    watching=false;
+    if (write(watchPipe[1], "", 1) != 1)
+      NVJ_LOG->append(NVJ_ERROR, "LocalRepository - can't stop the watcher thread");
+    wait_for_thread(watchThread);
+    close(watchFd);
+    close(watchPipe[0]);
+    close(watchPipe[1]);
+    watchFd=-1;
+    watchedDirs.clear();
+    return true;
+  }
+
+  if ( (watchFd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 )
+  {
+    NVJ_LOG->append(NVJ_ERROR, std::string("LocalRepository - inotify_init error : ")+strerror(errno));
+    return false;
+  }
+  if (pipe(watchPipe) == -1)
+  {
+    NVJ_LOG->append(NVJ_ERROR, std::string("LocalRepository - pipe error : ")+strerror(errno));
+    close(watchFd);
+    watchFd=-1;
+    return false;
+  }
+
+  addWatches("");
+  // the files created before the watch of their directory
+  reload();
+
+  watching=true;
+  create_thread(&watchThread, LocalRepository::startWatchThread, this);
+  return true;
+#else
+  if (b)
+    NVJ_LOG->append(NVJ_ERROR, "LocalRepository - watching the directories is only supported on Linux");
+  return !b;
+#endif
+}
+
+/**********************************************************************/
+/**
+* watch a directory and its subdirectories (called by the watcher thread, or before it starts)
+* @param subpath: the path of the directory in the local directory
+*/
+void LocalRepository::addWatches(const std::string& subpath)
+{
+#ifdef LINUX
+  std::string path=fullPathToLocalDir+subpath;
+  int wd=inotify_add_watch(watchFd, path.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                                                   | IN_CLOSE_WRITE | IN_ONLYDIR);
+  if (wd == -1)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "LocalRepository - can't watch '" + path + "' : " + strerror(errno));
+    return;
+  }
+  watchedDirs[wd]=subpath;
+
+  DIR *dir=opendir(path.c_str());
+  if (dir == NULL)
+    return;
+  struct dirent *entry;
+  struct stat s;
+  while ((entry = readdir (dir)) != NULL)
+  {
+    if (!strcmp(entry->d_name,".") || !strcmp(entry->d_name,".."))
+      continue;
+    if (stat((path+'/'+entry->d_name).c_str(), &s) == 0 && S_ISDIR(s.st_mode))
+      addWatches(subpath+'/'+entry->d_name);
+  }
+  closedir(dir);
+#endif
+}
+
+/**********************************************************************/
+/**
+* stop watching a directory moved away, and its subdirectories
+*/
+void LocalRepository::removeWatches(const std::string& subpath)
+{
+#ifdef LINUX
+  std::string prefix=subpath+'/';
+  for (std::map< int, std::string >::iterator it=watchedDirs.begin(); it!=watchedDirs.end(); )
+    if (it->second == subpath || !it->second.compare(0, prefix.size(), prefix))
+    {
+      inotify_rm_watch(watchFd, it->first);
+      watchedDirs.erase(it++);
+    }
+    else
+      it++;
+#endif
+}
+
+/**********************************************************************/
+
+void* LocalRepository::startWatchThread(void *t)
+{
+  static_cast<LocalRepository *>(t)->watch();
+  pthread_exit(NULL);
+  return NULL;
+}
+
+/**********************************************************************/
+/**
+* the watcher thread: applies the inotify events until setWatching(false)
+*/
+void LocalRepository::watch()
+{
+#ifdef LINUX
+  char buffer[64*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  while (watching)
+  {
+    struct pollfd fds[2];
+    fds[0].fd=watchFd; fds[0].events=POLLIN; fds[0].revents=0;
+    fds[1].fd=watchPipe[0]; fds[1].events=POLLIN; fds[1].revents=0;
+    if (poll(fds, 2, -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      NVJ_LOG->append(NVJ_ERROR, std::string("LocalRepository - poll error : ")+strerror(errno));
+      break;
+    }
+    if (fds[1].revents)
+      break;
+
+    ssize_t len=read(watchFd, buffer, sizeof buffer);
+    for (char *p=buffer; len > 0 && p < buffer+len; )
+    {
+      const struct inotify_event *event=(const struct inotify_event *)p;
+      applyEvent(event->wd, event->mask, event->len ? event->name : NULL);
+      p+=sizeof(struct inotify_event) + event->len;
+    }
+
+    // one new index for the batch of events
+    pthread_mutex_lock( &_mutex );
+    publishIndex();
+    pthread_mutex_unlock( &_mutex );
+  }
+#endif
+}
+
+/**********************************************************************/
+
+void LocalRepository::applyEvent(int wd, uint32_t mask, const char *name)
+{
+#ifdef LINUX
+  if (mask & IN_Q_OVERFLOW)
+  {
+    // events lost: watch and load everything again
+    NVJ_LOG->append(NVJ_WARNING, "LocalRepository - inotify queue overflow, reloading '" + fullPathToLocalDir + "'");
+    removeWatches("");
+    addWatches("");
+    reload();
+    return;
+  }
+
+  if (mask & IN_IGNORED)
+  {
+    watchedDirs.erase(wd);
+    return;
+  }
+
+  std::map< int, std::string >::const_iterator it=watchedDirs.find(wd);
+  if (it == watchedDirs.end() || name == NULL)
+    return;
+
+  std::string subpath=it->second+'/'+name;
+  std::string url=getUrl(subpath);
+
+  if (mask & (IN_CREATE | IN_MOVED_TO))
+  {
+    struct stat s;
+    if (stat((fullPathToLocalDir+subpath).c_str(), &s) == -1)
+      return;
+    if (S_ISDIR(s.st_mode))
+    {
+      // watched before being scanned: no file can be missed
+      addWatches(subpath);
+      addFiles(subpath);
+    }
+    else
+      if (S_ISREG(s.st_mode))
+      {
+        pthread_mutex_lock( &_mutex );
+        filenames[url]=MimeTypes::get(name);
+        indexChanged=true;
+        pthread_mutex_unlock( &_mutex );
+        invalidate(url);
+      }
+  }
+
+  if (mask & (IN_DELETE | IN_MOVED_FROM))
+  {
+    if ((mask & IN_ISDIR) && (mask & IN_MOVED_FROM))
+      removeWatches(subpath);
+    removeFiles(url);
+  }
+
+  if (mask & IN_CLOSE_WRITE)
+    invalidate(url);
+#endif
+}
+
+/**********************************************************************/
+
+std::string LocalRepository::getFilePath(const std::string& url)
+{
+  std::string filename=url;
 
   if (aliasName.size())
     filename.replace(0, aliasName.size(), fullPathToLocalDir);
   else
     filename=fullPathToLocalDir+'/'+filename;
 
-  FILE *pFile = fopen ( filename.c_str() , "rb" );
-  if (pFile==NULL)
+  return filename;
+}
+
+/**********************************************************************/
+
+static std::string fileVersion(const struct stat& s)
+{
+  char version[64];
+#ifdef LINUX
+  snprintf(version, sizeof version, "%lx.%lx-%lx", (unsigned long)s.st_mtim.tv_sec, (unsigned long)s.st_mtim.tv_nsec, (unsigned long)s.st_size);
+#else
+  snprintf(version, sizeof version, "%lx-%lx", (unsigned long)s.st_mtime, (unsigned long)s.st_size);
+#endif
+  return version;
+}
+
+/**********************************************************************/
+
+static inline bool sameFile(const struct stat& a, const struct stat& b)
+{
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size
+#ifdef LINUX
+    && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+#else
+    && a.st_mtime == b.st_mtime;
+#endif
+}
+
+/**********************************************************************/
+
+static inline bool isNotOlder(const struct stat& a, const struct stat& b)
+{
+#ifdef LINUX
+  return a.st_mtim.tv_sec > b.st_mtim.tv_sec || (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec >= b.st_mtim.tv_nsec);
+#else
+  return a.st_mtime >= b.st_mtime;
+#endif
+}
+
+/**********************************************************************/
+/**
+* open a file of the repository, from the cache of descriptors if it's
+* still valid
+* @param url: the url
+* @return the open file (to release with closeFile), or NULL
+*/
+LocalRepository::OpenFile* LocalRepository::openFile(const std::string& url)
+{
+  std::string filename=getFilePath(url);
+  time_t now=time(NULL);
+
+  pthread_mutex_lock( &fdCacheMutex );
+  std::map< std::string, OpenFile* >::iterator it=fdCache.find(url);
+  if (it != fdCache.end())
+  {
+    OpenFile *file=it->second;
+    file->refCount++;
+    fdCacheLru.splice(fdCacheLru.begin(), fdCacheLru, file->lruPos);
+    if (watching || now - file->checked < fdCacheValidity)
+    {
+      pthread_mutex_unlock( &fdCacheMutex );
+      return file;
+    }
+    pthread_mutex_unlock( &fdCacheMutex );
+
+    struct stat s;
+    bool valid=stat(filename.c_str(), &s) == 0 && sameFile(s, file->status);
+
+    pthread_mutex_lock( &fdCacheMutex );
+    if (valid)
+    {
+      file->checked=now;
+      pthread_mutex_unlock( &fdCacheMutex );
+      return file;
+    }
+    if (file->cached)
+      removeOpenFile(fdCache.find(url));
+    pthread_mutex_unlock( &fdCacheMutex );
+    closeFile(file);
+  }
+  else
+    pthread_mutex_unlock( &fdCacheMutex );
+
+  int fd=open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
   {
     char logBuffer[150];
     snprintf(logBuffer, 150, "Webserver : Error opening file '%s'", filename.c_str() );
     NVJ_LOG->append(NVJ_ERROR, logBuffer);
-    return false;
+    return NULL;
   }
 
-  // obtain file size.
-  fseek (pFile , 0 , SEEK_END);
-  webpageLen = ftell (pFile);
-  rewind (pFile);
+  OpenFile *file=new OpenFile;
+  if (fstat(fd, &file->status) == -1 || !S_ISREG(file->status.st_mode))
+  {
+    close (fd);
+    delete file;
+    return NULL;
+  }
+  file->fd=fd;
+  file->checked=now;
+  file->refCount=1;
+  file->cached=false;
 
-  if ( (webpage = (unsigned char *)malloc( webpageLen+1 * sizeof(char))) == NULL )
-    return false;
-  size_t nb=fread (webpage,1,webpageLen,pFile);
-  if (nb != webpageLen)
+  pthread_mutex_lock( &fdCacheMutex );
+  openFiles[fd]=file;
+  if (fdCacheMaxSize)
+  {
+    it=fdCache.find(url);
+    if (it != fdCache.end())
+      removeOpenFile(it);
+    file->refCount++; // the cache reference
+    file->cached=true;
+    fdCacheLru.push_front(url);
+    file->lruPos=fdCacheLru.begin();
+    fdCache[url]=file;
+    evictOpenFiles();
+  }
+  pthread_mutex_unlock( &fdCacheMutex );
+
+  return file;
+}
+
+/**********************************************************************/
+
+void LocalRepository::closeFile(OpenFile *file)
+{
+  pthread_mutex_lock( &fdCacheMutex );
+  if (--file->refCount == 0)
+  {
+    openFiles.erase(file->fd);
+    close (file->fd);
+    delete file;
+  }
+  pthread_mutex_unlock( &fdCacheMutex );
+}
+
+/**********************************************************************/
+
+void LocalRepository::freeFileContent(int fd)
+{
+  pthread_mutex_lock( &fdCacheMutex );
+  std::map< int, OpenFile* >::iterator it=openFiles.find(fd);
+  if (it != openFiles.end() && --it->second->refCount == 0)
+  {
+    close (fd);
+    delete it->second;
+    openFiles.erase(it);
+  }
+  pthread_mutex_unlock( &fdCacheMutex );
+}
+
+/**********************************************************************/
+/**
+* remove a file from the cache of descriptors (under fdCacheMutex)
+*/
+void LocalRepository::removeOpenFile(std::map< std::string, OpenFile* >::iterator it)
+{
+  OpenFile *file=it->second;
+  fdCacheLru.erase(file->lruPos);
+  fdCache.erase(it);
+  file->cached=false;
+  if (--file->refCount == 0)
+  {
+    openFiles.erase(file->fd);
+    close (file->fd);
+    delete file;
+  }
+}
+
+/**********************************************************************/
+
+void LocalRepository::evictOpenFiles()
+{
+  while (fdCache.size() > fdCacheMaxSize && !fdCacheLru.empty())
+    removeOpenFile(fdCache.find(fdCacheLru.back()));
+}
+
+/**********************************************************************/
+
+void LocalRepository::setOpenFileCacheSize(const size_t nbFiles, const time_t validity)
+{
+  pthread_mutex_lock( &fdCacheMutex );
+  fdCacheMaxSize=nbFiles;
+  fdCacheValidity=validity;
+  evictOpenFiles();
+  pthread_mutex_unlock( &fdCacheMutex );
+}
+
+/**********************************************************************/
+
+void LocalRepository::clearOpenFileCache()
+{
+  pthread_mutex_lock( &fdCacheMutex );
+  while (!fdCache.empty())
+    removeOpenFile(fdCache.begin());
+  pthread_mutex_unlock( &fdCacheMutex );
+}
+
+/**********************************************************************/
+/**
+* read an open file
+* @param file: the file
+* @return the content (to release with freeFile), or NULL
+*/
+unsigned char* LocalRepository::readFile(OpenFile *file)
+{
+  FileBuffer *buffer;
+  size_t length=file->status.st_size;
+
+  if ( (buffer = (FileBuffer *)malloc( sizeof(FileBuffer) + length+1 * sizeof(char))) == NULL )
+    return NULL;
+  buffer->refCount=1;
+  buffer->length=length;
+  if (FileReader::read(file->fd, getData(buffer), length) != (ssize_t)length)
   {
     char logBuffer[150];
-    snprintf(logBuffer, 150, "Webserver : Error accessing file '%s'", filename.c_str() );
+    snprintf(logBuffer, 150, "Webserver : Error accessing file (fd %d)", file->fd );
     NVJ_LOG->append(NVJ_ERROR, logBuffer);
-    return false;
+    free (buffer);
+    return NULL;
   }
-  
-  fclose (pFile);
-  response->setContent (webpage, webpageLen);
+
+  return getData(buffer);
+}
+
+/**********************************************************************/
+/**
+* read a file of the repository
+* @param url: the url
+* @param length: set to the file length
+* @param version: set to the version token (modification time and length)
+* @return the content (to release with freeFile), or NULL
+*/
+unsigned char* LocalRepository::readFile(const std::string& url, size_t *length, std::string& version)
+{
+  OpenFile *file=openFile(url);
+  if (file == NULL)
+    return NULL;
+
+  unsigned char *webpage=readFile(file);
+  *length=file->status.st_size;
+  version=fileVersion(file->status);
+  closeFile(file);
+  return webpage;
+}
+
+/**********************************************************************/
+
+void LocalRepository::release(FileBuffer *buffer)
+{
+  if (__sync_sub_and_fetch(&buffer->refCount, 1) == 0)
+    free (buffer);
+}
+
+/**********************************************************************/
+/**
+* get the content of a file from the cache
+* @param url: the url
+* @param version: the version token of the file
+* @param length: set to the file length
+* @return the content (to release with freeFile), or NULL if not cached
+*/
+unsigned char* LocalRepository::getCachedContent(const std::string& url, const std::string& version, size_t *length)
+{
+  pthread_mutex_lock( &cacheMutex );
+  std::map< std::string, CachedFile >::iterator it=cache.find(url);
+  if (it != cache.end() && it->second.version == version)
+  {
+    FileBuffer *buffer=it->second.buffer;
+    cacheLru.splice(cacheLru.begin(), cacheLru, it->second.lruPos);
+    __sync_fetch_and_add(&buffer->refCount, 1);
+    pthread_mutex_unlock( &cacheMutex );
+    __sync_fetch_and_add(&cacheHits, 1);
+    *length=buffer->length;
+    return getData(buffer);
+  }
+  pthread_mutex_unlock( &cacheMutex );
+  __sync_fetch_and_add(&cacheMisses, 1);
+  return NULL;
+}
+
+/**********************************************************************/
+/**
+* keep a content in the cache, if it's small enough
+*/
+void LocalRepository::cacheContent(const std::string& url, const std::string& version, unsigned char *webpage, size_t length)
+{
+  pthread_mutex_lock( &cacheMutex );
+  if (length > cacheMaxSize / 4)
+  {
+    pthread_mutex_unlock( &cacheMutex );
+    return;
+  }
+
+  std::map< std::string, CachedFile >::iterator it=cache.find(url);
+  if (it != cache.end())
+    removeCachedFile(it);
+
+  FileBuffer *buffer=getBuffer(webpage);
+  __sync_fetch_and_add(&buffer->refCount, 1); // the cache reference
+  cacheLru.push_front(url);
+  CachedFile& cached=cache[url];
+  cached.buffer=buffer;
+  cached.version=version;
+  cached.lruPos=cacheLru.begin();
+  cacheSize+=length;
+  evict();
+  pthread_mutex_unlock( &cacheMutex );
+}
+
+/**********************************************************************/
+
+void LocalRepository::removeCachedFile(std::map< std::string, CachedFile >::iterator it)
+{
+  cacheLru.erase(it->second.lruPos);
+  cacheSize-=it->second.buffer->length;
+  release(it->second.buffer);
+  cache.erase(it);
+}
+
+/**********************************************************************/
+
+void LocalRepository::evict()
+{
+  while (cacheSize > cacheMaxSize && !cacheLru.empty())
+    removeCachedFile(cache.find(cacheLru.back()));
+}
+
+/**********************************************************************/
+
+void LocalRepository::setCacheSize(const size_t size)
+{
+  pthread_mutex_lock( &cacheMutex );
+  cacheMaxSize=size;
+  evict();
+  pthread_mutex_unlock( &cacheMutex );
+}
+
+/**********************************************************************/
+
+size_t LocalRepository::getCacheSize()
+{
+  pthread_mutex_lock( &cacheMutex );
+  size_t size=cacheSize;
+  pthread_mutex_unlock( &cacheMutex );
+  return size;
+}
+
+/**********************************************************************/
+
+void LocalRepository::clearCache()
+{
+  pthread_mutex_lock( &cacheMutex );
+  while (!cache.empty())
+    removeCachedFile(cache.begin());
+  pthread_mutex_unlock( &cacheMutex );
+}
+
+/**********************************************************************/
+/**
+* the fingerprint of a file: the first bits of the FNV-1a 64 hash of its
+* content, cached until the file is modified
+* @param url: the url
+* @param version: the file version token
+* @param content: the file content, or NULL to read it
+* @param length: the file length
+*/
+std::string LocalRepository::getFingerprint(const std::string& url, const std::string& version, const unsigned char* content, size_t length)
+{
+  pthread_mutex_lock( &_mutex );
+  std::map< std::string, std::pair<std::string, std::string> >::const_iterator it=fingerprints.find(url);
+  if (it != fingerprints.end() && it->second.first == version)
+  {
+    std::string fingerprint=it->second.second;
+    pthread_mutex_unlock( &_mutex );
+    return fingerprint;
+  }
+  pthread_mutex_unlock( &_mutex );
+
+  unsigned char *webpage=NULL;
+  std::string contentVersion=version;
+  if (content == NULL)
+  {
+    if ( (webpage=readFile(url, &length, contentVersion)) == NULL )
+      return "";
+    content=webpage;
+  }
+
+  unsigned long long h=14695981039346656037ULL;
+  for (size_t i=0; i<length; i++)
+    h = (h ^ content[i]) * 1099511628211ULL;
+  if (webpage != NULL)
+    freeFile(webpage);
+
+  char fingerprint[FINGERPRINT_LENGTH + 1];
+  snprintf(fingerprint, sizeof fingerprint, "%0*llx", FINGERPRINT_LENGTH, h >> (64 - 4*FINGERPRINT_LENGTH));
+
+  pthread_mutex_lock( &_mutex );
+  fingerprints[url]=std::pair<std::string, std::string>(contentVersion, fingerprint);
+  pthread_mutex_unlock( &_mutex );
+
+  return fingerprint;
+}
+
+/**********************************************************************/
+
+std::string LocalRepository::getFingerprintedUrl(const std::string& url)
+{
+  size_t start=url.find_first_not_of('/');
+  if (!fingerprinting || start == std::string::npos)
+    return url;
+
+  std::string filename=url.substr(start);
+  bool exist=!filename.compare(0, aliasName.size(), aliasName) && fileExist(filename);
+
+  struct stat s;
+  if (!exist || stat(getFilePath(filename).c_str(), &s) == -1)
+    return url;
+
+  std::string fingerprint=getFingerprint(filename, fileVersion(s), NULL, 0);
+  if (fingerprint.empty())
+    return url;
+
+  return fingerprintUrl(url, fingerprint);
+}
+
+/**********************************************************************/
+
+/**
+* get the status of a file, from the cache of descriptors if enabled
+* @param url: the url
+* @param s: set to the status
+* @param file: set to the open file (to release with closeFile), or NULL
+* @return false if the file can't be accessed
+*/
+bool LocalRepository::getStatus(const std::string& url, struct stat& s, OpenFile **file)
+{
+  *file=NULL;
+  if (!fdCacheMaxSize)
+    return stat(getFilePath(url).c_str(), &s) == 0;
+
+  if ( (*file=openFile(url)) == NULL )
+    return false;
+  s=(*file)->status;
   return true;
 }
 
+/**********************************************************************/
+
+bool LocalRepository::getFile(HttpRequest* request, HttpResponse *response)
+{
+  std::string url = request->getUrl(), fingerprint;
+  const char *mimeType=NULL;
+  size_t webpageLen;
+  unsigned char *webpage;
+
+  if ( url.compare(0, aliasName.size(), aliasName) )
+    return false;
+
+  if ( !fileExist(url, &mimeType) )
+  {
+    std::string original;
+    if ( !fingerprinting || !parseFingerprintedUrl(url, original, fingerprint) || !fileExist(original, &mimeType) )
+      return false;
+    url=original;
+  }
+
+  // the status, from the cache of descriptors or with stat
+  OpenFile *file;
+  struct stat s;
+  if (!getStatus(url, s, &file))
+    return false;
+  std::string version=fileVersion(s), path=url;
 
+  // a gzip sidecar (url.gz) at least as recent as the file is sent instead
+  // to the clients accepting gzip
+  bool zipped=false;
+  if (precompressed && fileExist(url+".gz"))
+  {
+    response->setVaryAcceptEncoding();
+    OpenFile *gzFile;
+    struct stat gzs;
+    if (request->getAcceptEncoding().isAccepted("gzip") && getStatus(url+".gz", gzs, &gzFile))
+    {
+      if (isNotOlder(gzs, s))
+      {
+        if (file != NULL)
+          closeFile(file);
+        file=gzFile;
+        s=gzs;
+        path=url+".gz";
+        zipped=true;
+      }
+      else
+        if (gzFile != NULL)
+          closeFile(gzFile);
+    }
+  }
 
+  // the small files are served from the content cache, the others are
+  // sent from their descriptor
+  std::string pathVersion=fileVersion(s);
+  webpageLen=s.st_size;
+  bool cacheable=cacheMaxSize && webpageLen <= cacheMaxSize / 4;
+  webpage=NULL;
+  if (!cacheable || (webpage=getCachedContent(path, pathVersion, &webpageLen)) == NULL)
+  {
+    if ( file == NULL && (file=openFile(path)) == NULL )
+      return false;
+    pathVersion=fileVersion(file->status);
+    webpageLen=file->status.st_size;
+    if (cacheable)
+    {
+      if ( (webpage=readFile(file)) == NULL )
+      {
+        closeFile(file);
+        return false;
+      }
+      cacheContent(path, pathVersion, webpage, webpageLen);
+    }
+  }
+  if (webpage != NULL && file != NULL)
+  {
+    closeFile(file);
+    file=NULL;
+  }
+  if (!zipped)
+    version=pathVersion;
+
+  // a fingerprinted url is only served with the content it identifies
+  if (fingerprint.size())
+  {
+    if (getFingerprint(url, version, zipped ? NULL : webpage, webpageLen) != fingerprint)
+    {
+      if (webpage != NULL)
+        freeFile(webpage);
+      else
+        closeFile(file);
+      return false;
+    }
+    response->setCacheControl(IMMUTABLE_CACHE_CONTROL);
+  }
 
+  if (webpage != NULL)
+    response->setContent (webpage, webpageLen);
+  else
+    response->setFileContent (file->fd, webpageLen);
+  response->setIsZipped(zipped);
+  response->setContentVersion(pathVersion);
+  if (mimeType != NULL)
+    response->setMimeType(mimeType);
+  return true;
+}
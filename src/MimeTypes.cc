@@ -0,0 +1,166 @@
+//********************************************************
+/**
+ * @file  MimeTypes.cc
+ *
+ * @brief Registry of the mime types, by file extension
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "libnavajo/MimeTypes.hh"
+#include "libnavajo/nvjThread.h"
+
+
+MimeTypes::Table *MimeTypes::table=NULL;
+
+static pthread_mutex_t mimeTypesMutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mimeTypesOnce=PTHREAD_ONCE_INIT;
+
+static const char *defaultMimeTypes[][2] =
+{
+  { "html", "text/html" }, { "htm", "text/html" },
+  { "js", "application/javascript" }, { "mjs", "application/javascript" },
+  { "json", "application/json" }, { "map", "application/json" },
+  { "webmanifest", "application/manifest+json" },
+  { "xml", "application/xml" },
+  { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" },
+  { "gif", "image/gif" },
+  { "png", "image/png" },
+  { "svg", "image/svg+xml" },
+  { "ico", "image/x-icon" },
+  { "webp", "image/webp" },
+  { "css", "text/css" },
+  { "txt", "text/plain" },
+  { "csv", "text/csv" },
+  { "woff", "font/woff" }, { "woff2", "font/woff2" },
+  { "ttf", "font/ttf" }, { "otf", "font/otf" },
+  { "wasm", "application/wasm" },
+  { "au", "audio/basic" },
+  { "wav", "audio/wav" },
+  { "mp3", "audio/mpeg" },
+  { "avi", "video/x-msvideo" },
+  { "mpeg", "video/mpeg" }, { "mpg", "video/mpeg" },
+  { "mp4", "application/mp4" },
+  { "h264", "video/h264" },
+  { "dv", "video/dv" },
+  { "qt", "video/quicktime" }, { "mov", "video/quicktime" },
+  { "bin", "application/octet-stream" },
+  { "doc", "application/msword" }, { "docx", "application/msword" },
+  { "pdf", "application/pdf" },
+  { "ps", "application/postscript" }, { "eps", "application/postscript" }, { "ai", "application/postscript" },
+  { "tar", "application/x-tar" }
+};
+
+/**********************************************************************/
+/**
+* insert an entry, in a table with free slots
+*/
+void MimeTypes::insert(Table *t, const char *extension, size_t length, const char *mimeType)
+{
+  for (size_t i=hash(extension, length) & (t->size-1); ; i=(i+1) & (t->size-1))
+  {
+    Entry& e=t->entries[i];
+    if (e.extension == NULL)
+    {
+      e.extension=extension;
+      e.length=length;
+      e.mimeType=mimeType;
+      t->nbEntries++;
+      return;
+    }
+    if (e.length == length && !memcmp(e.extension, extension, length))
+    {
+      e.mimeType=mimeType;
+      return;
+    }
+  }
+}
+
+/**********************************************************************/
+
+void MimeTypes::init()
+{
+  for (size_t i=0; i<sizeof defaultMimeTypes / sizeof defaultMimeTypes[0]; i++)
+    put(defaultMimeTypes[i][0], defaultMimeTypes[i][1]);
+}
+
+/**********************************************************************/
+
+MimeTypes::Table* MimeTypes::getTable()
+{
+  pthread_once(&mimeTypesOnce, init);
+  return __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+}
+
+/**********************************************************************/
+
+void MimeTypes::add(const std::string& extension, const std::string& mimeType)
+{
+  pthread_once(&mimeTypesOnce, init);
+  put(extension, mimeType);
+}
+
+/**********************************************************************/
+
+void MimeTypes::put(const std::string& ext, const std::string& mimeType)
+{
+  size_t start=ext.size() && ext[0] == '.' ? 1 : 0;
+  if (start == ext.size() || mimeType.empty())
+    return;
+
+  char *extension=strdup(ext.c_str() + start);
+  for (char *c=extension; *c; c++)
+    if (*c >= 'A' && *c <= 'Z') *c += 'a' - 'A';
+
+  pthread_mutex_lock( &mimeTypesMutex );
+
+  // copy the table (keeping a load factor under 1/2); the previous versions
+  // are never freed, a reader may still use them
+  Table *previous=table;
+  Table *t=new Table;
+  t->nbEntries=0;
+  t->size=16;
+  while (previous != NULL && t->size < 2 * (previous->nbEntries + 1))
+    t->size*=2;
+  t->entries=(Entry *)calloc(t->size, sizeof(Entry));
+
+  if (previous != NULL)
+    for (size_t i=0; i<previous->size; i++)
+      if (previous->entries[i].extension != NULL)
+        insert(t, previous->entries[i].extension, previous->entries[i].length, previous->entries[i].mimeType);
+  insert(t, extension, strlen(extension), strdup(mimeType.c_str()));
+
+  __atomic_store_n(&table, t, __ATOMIC_RELEASE);
+  pthread_mutex_unlock( &mimeTypesMutex );
+}
+
+/**********************************************************************/
+
+const char* MimeTypes::getByExtension(const char *extension, size_t length)
+{
+  const Table *t=getTable();
+  for (size_t i=hash(extension, length) & (t->size-1); ; i=(i+1) & (t->size-1))
+  {
+    const Entry& e=t->entries[i];
+    if (e.extension == NULL)
+      return NULL;
+    if (e.length == length && !strncasecmp(e.extension, extension, length))
+      return e.mimeType;
+  }
+}
+
+/**********************************************************************/
+
+const char* MimeTypes::get(const char *filename)
+{
+  const char *ext=strrchr(filename, '.');
+  if (ext == NULL || strchr(ext, '/') != NULL)
+    return NULL;
+  ext++;
+  return getByExtension(ext, strlen(ext));
+}
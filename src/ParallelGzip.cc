@@ -0,0 +1,254 @@
+//********************************************************
+/**
+ * @file  ParallelGzip.cc
+ *
+ * @brief Block-parallel gzip compression of large contents
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "libnavajo/ParallelGzip.hh"
+#include "libnavajo/nvjGzip.h"
+#include "libnavajo/nvjThread.h"
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define GZIP_HEADER_SIZE 10
+#define GZIP_TRAILER_SIZE 8
+
+pthread_mutex_t ParallelGzip::poolMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ParallelGzip::poolCond = PTHREAD_COND_INITIALIZER;
+std::deque<ParallelGzip::Job*> ParallelGzip::jobs;
+unsigned ParallelGzip::nbThreads = 0;
+unsigned ParallelGzip::nbStartedThreads = 0;
+
+
+/**********************************************************************/
+/**
+* a content to compress: block i is deflated at dst + GZIP_HEADER_SIZE + i * blockBound
+*/
+struct ParallelGzip::Job
+{
+  const unsigned char *src;
+  size_t sizeSrc, blockSize, blockBound;
+  unsigned nbBlocks;
+  int level, strategy;
+  unsigned char *dst;
+  size_t *blockLen;
+  unsigned long *blockCrc;
+
+  volatile unsigned nextBlock, doneBlocks;
+  volatile int nbWorkers;
+  volatile bool failed;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/**********************************************************************/
+
+void ParallelGzip::setNbThreads(const unsigned n)
+{
+  pthread_mutex_lock( &poolMutex );
+  nbThreads=n;
+  pthread_mutex_unlock( &poolMutex );
+}
+
+/**********************************************************************/
+
+unsigned ParallelGzip::getNbThreads()
+{
+  pthread_mutex_lock( &poolMutex );
+  unsigned n=nbThreads;
+  pthread_mutex_unlock( &poolMutex );
+  return n;
+}
+
+/**********************************************************************/
+/**
+* start the missing worker threads (called with poolMutex locked)
+*/
+void ParallelGzip::startThreads()
+{
+  if (!nbThreads)
+  {
+    long nbCpu=sysconf(_SC_NPROCESSORS_ONLN);
+    nbThreads = nbCpu > 0 ? (unsigned)nbCpu : 1;
+  }
+
+  for (; nbStartedThreads < nbThreads; nbStartedThreads++)
+  {
+    pthread_t thread;
+    create_thread( &thread, ParallelGzip::workerThread, NULL );
+    pthread_detach(thread);
+  }
+}
+
+/**********************************************************************/
+
+void* ParallelGzip::workerThread(void *)
+{
+  while (true)
+  {
+    pthread_mutex_lock( &poolMutex );
+    while (jobs.empty())
+      pthread_cond_wait( &poolCond, &poolMutex );
+    Job *job=jobs.front();
+    jobs.pop_front();
+    __sync_fetch_and_add(&job->nbWorkers, 1);
+    pthread_mutex_unlock( &poolMutex );
+
+    processBlocks(job);
+
+    pthread_mutex_lock( &job->mutex );
+    __sync_sub_and_fetch(&job->nbWorkers, 1);
+    pthread_cond_signal( &job->cond );
+    pthread_mutex_unlock( &job->mutex );
+  }
+  return NULL;
+}
+
+/**********************************************************************/
+
+void ParallelGzip::processBlocks(Job *job)
+{
+  unsigned i;
+  while ( (i=__sync_fetch_and_add(&job->nextBlock, 1)) < job->nbBlocks )
+  {
+    if (!job->failed)
+    try
+    {
+      size_t offset=(size_t)i * job->blockSize;
+      size_t len=std::min(job->blockSize, job->sizeSrc - offset);
+      bool lastBlock = i == job->nbBlocks - 1;
+
+      z_stream *strm=nvj_thread_deflate_stream(true, job->level, job->strategy);
+
+      // prime the block with the end of the previous one
+      if (offset)
+      {
+        size_t dictLen=std::min((size_t)DEFLATE_WINDOW_SIZE, offset);
+        if (deflateSetDictionary(strm, job->src + offset - dictLen, dictLen) != Z_OK)
+          throw std::runtime_error(std::string("gzip : deflateSetDictionary error") );
+      }
+
+      strm->next_in = (Bytef*)job->src + offset;
+      strm->avail_in = len;
+      strm->next_out = job->dst + GZIP_HEADER_SIZE + (size_t)i * job->blockBound;
+      strm->avail_out = job->blockBound;
+
+      // the last block ends the deflate stream, the others end on a byte boundary
+      int ret=deflate(strm, lastBlock ? Z_FINISH : Z_SYNC_FLUSH);
+      if ( (lastBlock && ret != Z_STREAM_END) || (!lastBlock && ret != Z_OK) || strm->avail_in || !strm->avail_out )
+        throw std::runtime_error(std::string("gzip : deflate error") );
+
+      job->blockLen[i]=job->blockBound - strm->avail_out;
+      job->blockCrc[i]=crc32(crc32(0L, Z_NULL, 0), job->src + offset, len);
+    }
+    catch (...)
+    {
+      job->failed=true;
+    }
+
+    pthread_mutex_lock( &job->mutex );
+    job->doneBlocks++;
+    if (job->doneBlocks == job->nbBlocks)
+      pthread_cond_signal( &job->cond );
+    pthread_mutex_unlock( &job->mutex );
+  }
+}
+
+/**********************************************************************/
+
+size_t ParallelGzip::gzip(unsigned char** dst, const unsigned char* src, const size_t sizeSrc,
+                          const int level, const int strategy, const size_t blockSize)
+{
+  Job job;
+  job.src=src;
+  job.sizeSrc=sizeSrc;
+  job.blockSize=std::max(blockSize, (size_t)DEFLATE_WINDOW_SIZE);
+  job.nbBlocks=sizeSrc ? (unsigned)((sizeSrc + job.blockSize - 1) / job.blockSize) : 1;
+  job.level=level;
+  job.strategy=strategy;
+  job.blockBound=deflateBound(nvj_thread_deflate_stream(true, level, strategy), job.blockSize) + 64;
+  job.nextBlock=job.doneBlocks=0;
+  job.nbWorkers=0;
+  job.failed=false;
+
+  size_t sizeDst=GZIP_HEADER_SIZE + job.nbBlocks * job.blockBound + GZIP_TRAILER_SIZE;
+  job.dst=(unsigned char *)malloc(sizeDst);
+  job.blockLen=(size_t *)malloc(job.nbBlocks * sizeof(size_t));
+  job.blockCrc=(unsigned long *)malloc(job.nbBlocks * sizeof(unsigned long));
+  if (job.dst == NULL || job.blockLen == NULL || job.blockCrc == NULL)
+  {
+    free (job.dst); free (job.blockLen); free (job.blockCrc);
+    throw std::runtime_error(std::string("gzip : malloc error") );
+  }
+
+  pthread_mutex_init(&job.mutex, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  // hand the job to the pool, and compress with it
+  pthread_mutex_lock( &poolMutex );
+  startThreads();
+  unsigned nbHelpers=std::min(job.nbBlocks - 1, nbThreads);
+  for (unsigned i=0; i<nbHelpers; i++)
+    jobs.push_back(&job);
+  pthread_cond_broadcast( &poolCond );
+  pthread_mutex_unlock( &poolMutex );
+
+  processBlocks(&job);
+
+  // the busy workers never started the job: no need to wait for them
+  pthread_mutex_lock( &poolMutex );
+  jobs.erase(std::remove(jobs.begin(), jobs.end(), &job), jobs.end());
+  pthread_mutex_unlock( &poolMutex );
+
+  pthread_mutex_lock( &job.mutex );
+  while (job.doneBlocks < job.nbBlocks || job.nbWorkers)
+    pthread_cond_wait( &job.cond, &job.mutex );
+  pthread_mutex_unlock( &job.mutex );
+
+  pthread_mutex_destroy(&job.mutex);
+  pthread_cond_destroy(&job.cond);
+
+  if (job.failed)
+  {
+    free (job.dst); free (job.blockLen); free (job.blockCrc);
+    throw std::runtime_error(std::string("gzip : parallel compression error") );
+  }
+
+  // gzip member: header, the concatenated blocks, crc32 and size trailer
+  unsigned char *out=job.dst;
+  const unsigned char header[GZIP_HEADER_SIZE] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0,
+                        (unsigned char)(level == Z_BEST_COMPRESSION ? 2 : (level == Z_BEST_SPEED || strategy >= Z_HUFFMAN_ONLY) ? 4 : 0),
+                        3 /* unix */ };
+  memcpy(out, header, GZIP_HEADER_SIZE);
+
+  size_t len=GZIP_HEADER_SIZE;
+  unsigned long crc=crc32(0L, Z_NULL, 0);
+  for (unsigned i=0; i<job.nbBlocks; i++)
+  {
+    size_t blockOffset=GZIP_HEADER_SIZE + (size_t)i * job.blockBound;
+    if (blockOffset != len)
+      memmove(out + len, out + blockOffset, job.blockLen[i]);
+    len+=job.blockLen[i];
+
+    size_t blockSrcLen=std::min(job.blockSize, sizeSrc - (size_t)i * job.blockSize);
+    crc=crc32_combine(crc, job.blockCrc[i], blockSrcLen);
+  }
+
+  for (int i=0; i<4; i++)
+    out[len++]=(crc >> (8*i)) & 0xFF;
+  for (int i=0; i<4; i++)
+    out[len++]=((unsigned long)sizeSrc >> (8*i)) & 0xFF;
+
+  free (job.blockLen);
+  free (job.blockCrc);
+
+  *dst=out;
+  return len;
+}
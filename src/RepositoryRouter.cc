@@ -0,0 +1,201 @@
+//********************************************************
+/**
+ * @file  RepositoryRouter.cc
+ *
+ * @brief Dispatches the requests to the web repositories
+ *
+ * @version 1
+ */
+//********************************************************
+
+#include <algorithm>
+#include <sched.h>
+
+#include "libnavajo/RepositoryRouter.hh"
+
+
+volatile unsigned WebRepository::routesGeneration=0;
+
+/**********************************************************************/
+
+RepositoryRouter::RepositoryRouter() : table(NULL), current(NULL)
+{
+  pthread_mutex_init(&_mutex, NULL);
+  tableReaders[0]=tableReaders[1]=0;
+  tableEpoch=0;
+}
+
+/**********************************************************************/
+
+RepositoryRouter::~RepositoryRouter()
+{
+  if (current != NULL)
+    deleteTable(current);
+  pthread_mutex_destroy(&_mutex);
+}
+
+/**********************************************************************/
+
+void RepositoryRouter::deleteTable(Table *t)
+{
+  for (size_t i=0; i<t->nodes.size(); i++)
+    delete t->nodes[i];
+  delete t;
+}
+
+/**********************************************************************/
+
+void RepositoryRouter::add(WebRepository *repository)
+{
+  if (repository == NULL)
+    return;
+
+  pthread_mutex_lock( &_mutex );
+  repositories.push_back(repository);
+  __atomic_store_n(&table, (Table *)NULL, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock( &_mutex );
+}
+
+/**********************************************************************/
+
+RepositoryRouter::Node* RepositoryRouter::getChild(const Node *node, char c)
+{
+  for (size_t i=0; i<node->children.size(); i++)
+    if (node->children[i].first == c)
+      return node->children[i].second;
+  return NULL;
+}
+
+/**********************************************************************/
+/**
+* compute the repositories of a node and its children (called with _mutex locked)
+* @param node: the node, whose lists hold its own prefix and exact routes
+* @param passing: the prefix routes of the parent
+*/
+void RepositoryRouter::complete(Node *node, const std::vector<WebRepository *>& passing)
+{
+  std::vector<WebRepository *> prefixes, exacts;
+  prefixes.swap(node->passing);
+  exacts.swap(node->ending);
+
+  // keep the registration order
+  for (size_t i=0; i<repositories.size(); i++)
+  {
+    WebRepository *repository=repositories[i];
+    bool prefix = std::find(passing.begin(), passing.end(), repository) != passing.end()
+      || std::find(prefixes.begin(), prefixes.end(), repository) != prefixes.end();
+    if (prefix)
+      node->passing.push_back(repository);
+    if (prefix || std::find(exacts.begin(), exacts.end(), repository) != exacts.end())
+      node->ending.push_back(repository);
+  }
+
+  for (size_t i=0; i<node->children.size(); i++)
+    complete(node->children[i].second, node->passing);
+}
+
+/**********************************************************************/
+
+void RepositoryRouter::rebuild()
+{
+  pthread_mutex_lock( &_mutex );
+
+  unsigned generation=__atomic_load_n(&WebRepository::routesGeneration, __ATOMIC_ACQUIRE);
+  Table *t=table;
+  if (t == NULL || t->generation != generation)
+  {
+    t=new Table;
+    t->generation=generation;
+    t->root=new Node;
+    t->nodes.push_back(t->root);
+
+    for (size_t i=0; i<repositories.size(); i++)
+    {
+      std::vector<WebRoute> routes;
+      repositories[i]->getRoutes(routes);
+
+      for (size_t r=0; r<routes.size(); r++)
+      {
+        const std::string& url=routes[r].url;
+        size_t c=url.find_first_not_of('/');
+        Node *node=t->root;
+        for ( ; c < url.size(); c++)
+        {
+          Node *child=getChild(node, url[c]);
+          if (child == NULL)
+          {
+            child=new Node;
+            t->nodes.push_back(child);
+            node->children.push_back(std::make_pair(url[c], child));
+          }
+          node=child;
+        }
+        (routes[r].prefix ? node->passing : node->ending).push_back(repositories[i]);
+      }
+    }
+
+    complete(t->root, std::vector<WebRepository *>());
+    __atomic_store_n(&table, t, __ATOMIC_SEQ_CST);
+
+    // a reader may have read the epoch before a flip and counted itself
+    // after: wait for the readers of one parity, then of the other one
+    Table *previous=current;
+    current=t;
+    for (int i=0; previous != NULL && i<2; i++)
+    {
+      unsigned parity=__atomic_fetch_add(&tableEpoch, 1, __ATOMIC_SEQ_CST) & 1;
+      while (__atomic_load_n(&tableReaders[parity], __ATOMIC_ACQUIRE))
+        sched_yield();
+    }
+    if (previous != NULL)
+      deleteTable(previous);
+  }
+
+  pthread_mutex_unlock( &_mutex );
+}
+
+/**********************************************************************/
+
+void RepositoryRouter::build()
+{
+  rebuild();
+}
+
+/**********************************************************************/
+
+/**
+* get the repositories of an url, copied while the table is read: a table
+* may be deleted as soon as its readers have left it
+*/
+void RepositoryRouter::lookup(const char *url, std::vector<WebRepository *>& repositories)
+{
+  while (*url == '/') url++;
+
+  for (bool rebuilt=false; ; rebuilt=true)
+  {
+    unsigned parity=__atomic_load_n(&tableEpoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&tableReaders[parity], 1, __ATOMIC_SEQ_CST);
+    const Table *t=__atomic_load_n(&table, __ATOMIC_SEQ_CST);
+
+    // rebuild a missing or outdated table, out of the reader section
+    if (t != NULL && (rebuilt || t->generation == __atomic_load_n(&WebRepository::routesGeneration, __ATOMIC_ACQUIRE)))
+    {
+      const Node *node=t->root;
+      const char *c=url;
+      for ( ; *c; c++)
+      {
+        const Node *child=getChild(node, *c);
+        if (child == NULL)
+          break;
+        node=child;
+      }
+      const std::vector<WebRepository *>& found = *c ? node->passing : node->ending;
+      repositories.assign(found.begin(), found.end());
+      __atomic_sub_fetch(&tableReaders[parity], 1, __ATOMIC_RELEASE);
+      return;
+    }
+
+    __atomic_sub_fetch(&tableReaders[parity], 1, __ATOMIC_RELEASE);
+    rebuild();
+  }
+}
@@ -26,26 +26,33 @@
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#ifdef LINUX
+#include <signal.h>
+#include <sys/sendfile.h>
+#endif
 
 #include "libnavajo/WebServer.hh"
 #include "libnavajo/nvjSocket.h"
 #include "libnavajo/nvjGzip.h"
 #include "libnavajo/htonll.h"
 #include "libnavajo/WebSocket.hh"
+#include "libnavajo/MimeTypes.hh"
+#include "libnavajo/FileReader.hh"
 
 #include "MPFDParser/Parser.h"
 
 #define DEFAULT_HTTP_PORT 8080
+#define SENDFILE_CHUNK_SIZE (64*1024)
 #define LOGHIST_EXPIRATION_DELAY 600
 #define BUFSIZE 32768
+#define SD_LISTEN_FDS_START 3
+#define SOCKETS_HANDOFF_TIMEOUT 5000 // ms
 
 const char WebServer::authStr[]="Authorization: Basic ";
 const int WebServer::verify_depth=512;
 char *WebServer::certpass=NULL;
 std::string WebServer::webServerName;
 pthread_mutex_t IpAddress::resolvIP_mutex = PTHREAD_MUTEX_INITIALIZER;
-HttpSession::HttpSessionsContainerMap HttpSession::sessions;
-pthread_mutex_t HttpSession::sessions_mutex=PTHREAD_MUTEX_INITIALIZER;
 const std::string WebServer::base64_chars =
              "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
              "abcdefghijklmnopqrstuvwxyz"
@@ -53,9 +60,6 @@ const std::string WebServer::base64_chars =
 const std::string WebServer::webSocketMagicString="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 
-time_t HttpSession::lastExpirationSearchTime=0;
-time_t HttpSession::sessionLifeTime=20*60;
-
 #ifndef MSG_NOSIGNAL
   #define MSG_NOSIGNAL 0
 #endif
@@ -73,6 +77,8 @@ WebServer::WebServer()
   exitedThread=0;
   httpdAuth=false;
   nbServerSock=0;
+  serverSockShared=false;
+  socketsHandoffSock=-1;
   
   disableIpV4=false;
   disableIpV6=false;
@@ -229,6 +235,21 @@ size_t WebServer::recvLine(int client, char *bufLine, size_t nsize)
   return bufLineLen;
 }
 
+/***********************************************************************
+* freeContent:  Release a content given by a repository, or read from
+* the file it gave (NULL: the file wasn't read)
+***********************************************************************/
+
+static inline void freeContent(WebRepository *repo, unsigned char *content, bool read)
+{
+  if (content == NULL)
+    return;
+  if (read)
+    free (content);
+  else
+    repo->freeFile(content);
+}
+
 
 /***********************************************************************
 * accept_request:  Process a request
@@ -251,6 +272,8 @@ bool WebServer::accept_request(ClientSockData* client)
   char *requestParams=NULL;
   char *requestCookies=NULL;
   char *requestOrigin=NULL;
+  char *requestAcceptEncoding=NULL;
+  char *requestIfNoneMatch=NULL;
   char *webSocketClientKey=NULL;
   bool websocket=false;
   int webSocketVersion=-1;
@@ -286,12 +309,15 @@ bool WebServer::accept_request(ClientSockData* client)
     if (requestParams != NULL) { free (requestParams);  requestParams=NULL; };
     if (requestCookies != NULL) { free (requestCookies); requestCookies=NULL; };
     if (requestOrigin != NULL) { free (requestOrigin); requestOrigin=NULL; };
+    if (requestAcceptEncoding != NULL) { free (requestAcceptEncoding); requestAcceptEncoding=NULL; };
+    if (requestIfNoneMatch != NULL) { free (requestIfNoneMatch); requestIfNoneMatch=NULL; };
     if (webSocketClientKey != NULL) { free (webSocketClientKey); webSocketClientKey=NULL; };
     if (mutipartContent != NULL) { free (mutipartContent); mutipartContent=NULL; };
     if (mutipartContentParser != NULL) { delete mutipartContentParser; mutipartContentParser=NULL; };
     
     websocket=false;
     webSocketVersion=-1;
+    client->compression=NONE;
     //////////////////////////
 
     while (true)
@@ -360,8 +386,16 @@ bool WebServer::accept_request(ClientSockData* client)
         if (strncasecmp(bufLine+j, "Accept-Encoding: ",17) == 0) 
         { 
           j+=17;
-          if (strstr(bufLine+j,"gzip") != NULL)
-            client->compression=GZIP;
+          requestAcceptEncoding = (char*) malloc ( (strlen(bufLine+j)+1) * sizeof(char) );
+          strcpy(requestAcceptEncoding, bufLine+j);
+          continue;
+        }
+
+        if (strncasecmp(bufLine+j, "If-None-Match: ",15) == 0) 
+        { 
+          j+=15;
+          requestIfNoneMatch = (char*) malloc ( (strlen(bufLine+j)+1) * sizeof(char) );
+          strcpy(requestIfNoneMatch, bufLine+j);
           continue;
         }
 
@@ -604,6 +638,8 @@ bool WebServer::accept_request(ClientSockData* client)
         if (requestParams != NULL) free (requestParams);
         if (requestCookies != NULL) free (requestCookies);
         if (requestOrigin != NULL) free (requestOrigin);
+        if (requestAcceptEncoding != NULL) free (requestAcceptEncoding);
+        if (requestIfNoneMatch != NULL) free (requestIfNoneMatch);
         if (webSocketClientKey != NULL) free (webSocketClientKey);
         if (mutipartContent != NULL) free (mutipartContent);
         if (mutipartContentParser != NULL) delete mutipartContentParser;
@@ -626,28 +662,35 @@ bool WebServer::accept_request(ClientSockData* client)
     bool fileFound=false;
     unsigned char *webpage = NULL;
     size_t webpageLen = 0;
-    unsigned char *gzipWebPage=NULL;
-    int sizeZip=0;
+    unsigned char *encodedWebPage=NULL;
+    size_t sizeEncoded=0;
     bool zippedFile=false;
+    int fileFd=-1;          // content sent from its file
+    bool contentRead=false; // file content read in memory, to free
+    const ContentCoding *coding=NULL;
+    CompressedContentCache::Entry *cachedEncoded=NULL;
 
     HttpRequest request(requestMethod, urlBuffer, requestParams, requestCookies, requestOrigin, username, client, jsonPayload.c_str(), mutipartContentParser);
+    request.setAcceptEncoding(requestAcceptEncoding);
+    const AcceptEncoding& acceptEncoding=request.getAcceptEncoding();
+    if (acceptEncoding.isAccepted("gzip"))
+      client->compression=GZIP;
 
-    const char *mime=get_mime_type(urlBuffer); 
-    std::string mimeStr; if (mime != NULL) mimeStr=mime;
-    HttpResponse response(mimeStr);
+    HttpResponse response;
 
-    std::vector<WebRepository *>::const_iterator repo=webRepositories.begin();
-    for( ; repo!=webRepositories.end() && !fileFound && !zippedFile;)
+    std::vector<WebRepository *> repositories;
+    repositoryRouter.lookup(urlBuffer, repositories);
+    std::vector<WebRepository *>::const_iterator repo=repositories.begin();
+    for( ; repo!=repositories.end() && !fileFound && !zippedFile;)
     {
-      if (*repo == NULL) continue;
-
       fileFound = (*repo)->getFile(&request, &response);
       if (fileFound && response.getForwardedUrl() != "")
       {
         urlBuffer = (char*) realloc( urlBuffer, (response.getForwardedUrl().size() + 1) * sizeof(char) ); 
         strcpy( urlBuffer, response.getForwardedUrl().c_str() );
         response.forwardTo("");
-        repo=webRepositories.begin(); fileFound=false;
+        repositoryRouter.lookup(urlBuffer, repositories);
+        repo=repositories.begin(); fileFound=false;
       }
       else
          repo++;
@@ -666,10 +709,20 @@ bool WebServer::accept_request(ClientSockData* client)
     else
     {
       repo--;
+      if (response.getMimeType().empty())
+      {
+        const char *mime=MimeTypes::get(urlBuffer);
+        if (mime != NULL) response.setMimeType(mime);
+      }
       response.getContent(&webpage, &webpageLen, &zippedFile);
+      fileFd=response.getFileContent();
       
-      if ( webpage == NULL || !webpageLen)
+      if ( (webpage == NULL && fileFd == -1) || !webpageLen)
       {
+        if (webpage != NULL)
+          (*repo)->freeFile(webpage);
+        if (fileFd != -1)
+          (*repo)->freeFileContent(fileFd);
         std::string msg = getNoContentErrorMsg();
         httpSend(client, (const void*) msg.c_str(), msg.length());
 
@@ -678,8 +731,8 @@ bool WebServer::accept_request(ClientSockData* client)
         
       if (zippedFile)
       {
-        gzipWebPage = webpage;
-        sizeZip = webpageLen;
+        encodedWebPage = webpage;
+        sizeEncoded = webpageLen;
       }
     }
     #ifdef DEBUG_TRACES
@@ -687,14 +740,84 @@ bool WebServer::accept_request(ClientSockData* client)
     NVJ_LOG->append(NVJ_DEBUG,bufLinestr);
     #endif
 
+    // Content coding
+    const CompressionPolicy *policy=response.getCompressionPolicy();
+    if (policy == NULL) policy=(*repo)->getCompressionPolicy();
+    if (policy == NULL) policy=&compressionPolicy;
+
+    // the response depends on the Accept-Encoding header
+    bool varyAcceptEncoding=zippedFile || response.isVaryAcceptEncoding();
+
+    if ( !zippedFile && policy->shouldCompress(response.getMimeType(), webpageLen) )
+    {
+      varyAcceptEncoding=true;
+      coding=ContentCoding::negotiate(acceptEncoding);
+    }
+
+    // Entity tag of the representation sent
+    std::string identityETag=response.getETag();
+    if (identityETag.size())
+    {
+      if (coding != NULL)
+        response.setETag(codedETag(response.getETag(), coding->getName()));
+      else
+        if ( (client->compression == NONE) && zippedFile )
+          response.setETag("");
+    }
+
+    if (requestIfNoneMatch != NULL && response.getETag().size() && isETagMatching(requestIfNoneMatch, response.getETag()))
+    {
+      if (keepAlive && !(--nbFileKeepAlive)) keepAlive=false;
+      std::string header = getHttpHeader("304 Not Modified", 0, keepAlive, NULL, &response, varyAcceptEncoding);
+      bool sent = httpSend(client, (const void*) header.c_str(), header.length());
+      if (fileFd != -1)
+        (*repo)->freeFileContent(fileFd);
+      else
+        (*repo)->freeFile(webpage);
+      if (!sent)
+        goto FREE_RETURN_TRUE;
+      continue;
+    }
+
+    // a compressed content may be cached: its file isn't read then
+    if (coding != NULL && response.getContentVersion().size() && compressedCache.getMaxSize())
+      cachedEncoded=compressedCache.get(*repo, urlBuffer, response.getContentVersion(), coding->getName().c_str(), *policy);
+
+    if (cachedEncoded != NULL && fileFd != -1)
+    {
+      (*repo)->freeFileContent(fileFd);
+      fileFd=-1;
+    }
+
+    // a file content to (un)compress is read in memory
+    if ( fileFd != -1 && (coding != NULL || ((client->compression == NONE) && zippedFile)) )
+    {
+      webpage=(unsigned char *)malloc(webpageLen);
+      bool read=webpage != NULL && FileReader::read(fileFd, webpage, webpageLen) == (ssize_t)webpageLen;
+      (*repo)->freeFileContent(fileFd);
+      fileFd=-1;
+      contentRead=true;
+      if (!read)
+      {
+        NVJ_LOG->append(NVJ_ERROR, std::string("Webserver: can't read the content of ") + urlBuffer);
+        free (webpage);
+        std::string msg = getInternalServerErrorMsg();
+        httpSend(client, (const void*) msg.c_str(), msg.length());
+        goto FREE_RETURN_TRUE;
+      }
+      if (zippedFile)
+        encodedWebPage = webpage;
+    }
+
     if ( (client->compression == NONE) && zippedFile )
     {
       // Need to uncompress
       try
       {
-        if ((int)(webpageLen=nvj_gunzip( &webpage, gzipWebPage, sizeZip )) < 0)
+        if ((int)(webpageLen=nvj_gunzip( &webpage, encodedWebPage, sizeEncoded )) < 0)
         {
           NVJ_LOG->append(NVJ_ERROR, "Webserver: gunzip decompression failed !");
+          freeContent(*repo, encodedWebPage, contentRead);
           std::string msg = getInternalServerErrorMsg();
           httpSend(client, (const void*) msg.c_str(), msg.length());
           goto FREE_RETURN_TRUE;
@@ -703,77 +826,91 @@ bool WebServer::accept_request(ClientSockData* client)
       catch(...)
       {
           NVJ_LOG->append(NVJ_ERROR, "Webserver: nvj_gunzip raised an exception");
+          freeContent(*repo, encodedWebPage, contentRead);
           std::string msg = getInternalServerErrorMsg();
           httpSend(client, (const void*) msg.c_str(), msg.length());
           goto FREE_RETURN_TRUE;
       }
     }
 
-    // Need to compress
-    if ( !zippedFile && (client->compression == GZIP) && (webpageLen > 2048) )
+    if (coding != NULL)
     {
-      const char *mimetype=response.getMimeType().c_str();
-      if (mimetype != NULL && (strncmp(mimetype,"application",11) == 0 || strncmp(mimetype,"text",4) == 0))
+      const std::string& version=response.getContentVersion();
+      if (cachedEncoded != NULL)
       {
+        encodedWebPage=cachedEncoded->data;
+        sizeEncoded=cachedEncoded->length;
+      }
+      else
         try
         {
-          if ((int)(sizeZip=nvj_gzip( &gzipWebPage, webpage, webpageLen )) < 0)
+          sizeEncoded=coding->encode( &encodedWebPage, webpage, webpageLen, *policy );
+          if (sizeEncoded>webpageLen)
           {
-            NVJ_LOG->append(NVJ_ERROR, "Webserver: gunzip compression failed !");
+            sizeEncoded=0;
+            free (encodedWebPage);
+            coding=NULL;
+            response.setETag(identityETag);
+          }
+          else
+            if (version.size() && compressedCache.getMaxSize())
+              cachedEncoded=compressedCache.put(*repo, urlBuffer, version, coding->getName().c_str(), *policy, encodedWebPage, sizeEncoded);
+        }
+        catch(std::exception& e)
+        {
+            NVJ_LOG->append(NVJ_ERROR, std::string("Webserver: content encoding failed - ") + e.what());
             std::string msg = getInternalServerErrorMsg();
             httpSend(client, (const void*) msg.c_str(), msg.length());
+            freeContent(*repo, webpage, contentRead);
             goto FREE_RETURN_TRUE;
-          }
-          else
-            if ((size_t)sizeZip>webpageLen)
-            {
-              sizeZip=0;
-              free (gzipWebPage);
-            }
-          }
-          catch(...)
-          {
-              NVJ_LOG->append(NVJ_ERROR, "Webserver: nvj_gzip raised an exception");
-              std::string msg = getInternalServerErrorMsg();
-              httpSend(client, (const void*) msg.c_str(), msg.length());
-              goto FREE_RETURN_TRUE;
-          }
-      }
+        }
     }
 
+    const char *contentEncoding=NULL;
+    if (coding != NULL)
+      contentEncoding=coding->getName().c_str();
+    else
+      if (zippedFile && (client->compression == GZIP))
+        contentEncoding="gzip";
+
     if (keepAlive && !(--nbFileKeepAlive)) keepAlive=false;
 
-    if (sizeZip>0 && (client->compression == GZIP))
+    bool sent;
+    if (contentEncoding != NULL)
     {  
-      std::string header = getHttpHeader("200 OK", sizeZip, keepAlive, true, &response);
-      if ( !httpSend(client, (const void*) header.c_str(), header.length())
-        || !httpSend(client, (const void*) gzipWebPage, sizeZip) )
-        goto FREE_RETURN_TRUE;
+      std::string header = getHttpHeader("200 OK", sizeEncoded, keepAlive, contentEncoding, &response, varyAcceptEncoding);
+      sent = httpSend(client, (const void*) header.c_str(), header.length())
+          && (fileFd != -1 ? httpSendFile(client, fileFd, sizeEncoded) : httpSend(client, (const void*) encodedWebPage, sizeEncoded));
     }
     else
     {
-      std::string header = getHttpHeader("200 OK", webpageLen, keepAlive, false, &response);
-      if ( !httpSend(client, (const void*) header.c_str(), header.length())
-        || !httpSend(client, (const void*) webpage, webpageLen) )
-        goto FREE_RETURN_TRUE;
+      std::string header = getHttpHeader("200 OK", webpageLen, keepAlive, NULL, &response, varyAcceptEncoding);
+      sent = httpSend(client, (const void*) header.c_str(), header.length())
+          && (fileFd != -1 ? httpSendFile(client, fileFd, webpageLen) : httpSend(client, (const void*) webpage, webpageLen));
     }
 
-    if (sizeZip>0 && !zippedFile) // cas compression = double desalloc
+    if (coding != NULL) // cas compression = double desalloc
     {
-      free (gzipWebPage);
-      (*repo)->freeFile(webpage); 
-      continue;
-    }
-
-    if ((client->compression == NONE) && zippedFile) // cas décompression = double desalloc
-    {
-      free (webpage);
-      (*repo)->freeFile(gzipWebPage);
-      continue;
+      if (cachedEncoded != NULL)
+        CompressedContentCache::release(cachedEncoded);
+      else
+        free (encodedWebPage);
+      freeContent(*repo, webpage, contentRead);
     }
+    else
+      if ((client->compression == NONE) && zippedFile) // cas décompression = double desalloc
+      {
+        free (webpage);
+        freeContent(*repo, encodedWebPage, contentRead);
+      }
+      else
+        if (fileFd != -1)
+          (*repo)->freeFileContent(fileFd);
+        else
+          freeContent(*repo, webpage, contentRead);
 
-    (*repo)->freeFile(webpage); 
-
+    if (!sent)
+      goto FREE_RETURN_TRUE;
   }
   while (keepAlive && !exiting);
   
@@ -783,6 +920,8 @@ bool WebServer::accept_request(ClientSockData* client)
   if (requestParams != NULL) free (requestParams);
   if (requestCookies != NULL) free (requestCookies);
   if (requestOrigin != NULL) free (requestOrigin);
+  if (requestAcceptEncoding != NULL) free (requestAcceptEncoding);
+  if (requestIfNoneMatch != NULL) free (requestIfNoneMatch);
   if (webSocketClientKey != NULL) free (webSocketClientKey);
   if (mutipartContent != NULL) free (mutipartContent);
   if (mutipartContentParser != NULL) delete mutipartContentParser;
@@ -820,6 +959,62 @@ bool WebServer::httpSend(ClientSockData *client, const void *buf, size_t len)
     return sendCompat (client->socketId, buf, len, MSG_NOSIGNAL ) == (int)len;
 }
 
+/***********************************************************************
+* httpSendFile - send a file content from the socket (with sendfile, on
+* Linux without SSL)
+* @param client - the ClientSockData to use
+* @param fd - the file descriptor, read from the beginning
+* @param len - the data length
+* \return false if it's failed
+***********************************************************************/
+
+bool WebServer::httpSendFile(ClientSockData *client, int fd, size_t len)
+{
+#ifdef LINUX
+  if (client->bio == NULL)
+  {
+    // no MSG_NOSIGNAL for sendfile: SIGPIPE is blocked while sending, and
+    // the signal raised by a closed connection is consumed
+    sigset_t pipeSet, previousSet;
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, &previousSet);
+
+    off_t offset=0;
+    bool sent=true;
+    while (sent && (size_t)offset < len)
+    {
+      ssize_t n=sendfile(client->socketId, fd, &offset, len - offset);
+      if (n == -1 && errno == EINTR)
+        continue;
+      sent=n > 0;
+    }
+
+    if (!sent && !sigismember(&previousSet, SIGPIPE))
+    {
+      struct timespec noWait={ 0, 0 };
+      sigtimedwait(&pipeSet, NULL, &noWait);
+    }
+    pthread_sigmask(SIG_SETMASK, &previousSet, NULL);
+    return sent;
+  }
+#endif
+
+  unsigned char *buffer=(unsigned char *)malloc(SENDFILE_CHUNK_SIZE);
+  if (buffer == NULL)
+    return false;
+  bool sent=true;
+  for (size_t offset=0; sent && offset < len; )
+  {
+    size_t chunk=len - offset < SENDFILE_CHUNK_SIZE ? len - offset : SENDFILE_CHUNK_SIZE;
+    ssize_t n=FileReader::read(fd, buffer, chunk, offset);
+    sent=n > 0 && httpSend(client, buffer, n);
+    offset+=n;
+  }
+  free (buffer);
+  return sent;
+}
+
 /***********************************************************************
 * fatalError:  Print out a system error and exit
 * @param s - error message
@@ -839,40 +1034,7 @@ void WebServer::fatalError(const char *s)
 
 const char* WebServer::get_mime_type(const char *name)
 {
-  char *ext = strrchr(const_cast<char*>(name), '.');
-  if (!ext) return NULL;
-
-  char extLowerCase[6]; unsigned i=0;
-  for (; i<5 && i<strlen(ext); i++)
-    { extLowerCase[i]=ext[i]; if((extLowerCase[i]>='A')&&(extLowerCase[i]<='Z')) extLowerCase[i]+= 'a'-'A'; }
-  extLowerCase[i]='\0';
-
-  if (strcmp(extLowerCase, ".html") == 0 || strcmp(extLowerCase, ".htm") == 0) return "text/html";
-  if (strcmp(extLowerCase, ".js") == 0) return "application/javascript";
-  if (strcmp(extLowerCase, ".json") == 0) return "application/json";
-  if (strcmp(extLowerCase, ".xml") == 0) return "application/xml";
-  if (strcmp(extLowerCase, ".jpg") == 0 || strcmp(extLowerCase, ".jpeg") == 0) return "image/jpeg";
-  if (strcmp(extLowerCase, ".gif") == 0) return "image/gif";
-  if (strcmp(extLowerCase, ".png") == 0) return "image/png";
-  if (strcmp(extLowerCase, ".css") == 0) return "text/css";
-  if (strcmp(extLowerCase, ".txt") == 0) return "text/plain";
-  if (strcmp(extLowerCase, ".au") == 0) return "audio/basic";
-  if (strcmp(extLowerCase, ".wav") == 0) return "audio/wav";
-  if (strcmp(extLowerCase, ".avi") == 0) return "video/x-msvideo";
-  if (strcmp(extLowerCase, ".mpeg") == 0 || strcmp(extLowerCase, ".mpg") == 0) return "video/mpeg";
-  if (strcmp(extLowerCase, ".mp3") == 0) return "audio/mpeg";
-  if (strcmp(extLowerCase, ".csv") == 0) return "text/csv";
-  if (strcmp(extLowerCase, ".mp4") == 0) return "application/mp4";
-  if (strcmp(extLowerCase, ".bin") == 0) return "application/octet-stream";
-  if (strcmp(extLowerCase, ".doc") == 0 || strcmp(extLowerCase, ".docx") == 0) return "application/msword";
-  if (strcmp(extLowerCase, ".pdf") == 0) return "application/pdf";
-  if (strcmp(extLowerCase, ".ps") == 0 || strcmp(extLowerCase, ".eps") == 0 || strcmp(extLowerCase, ".ai") == 0) return "application/postscript";
-  if (strcmp(extLowerCase, ".tar") == 0) return "application/x-tar";
-  if (strcmp(extLowerCase, ".h264") == 0) return "video/h264";
-  if (strcmp(extLowerCase, ".dv") == 0) return "video/dv";
-  if (strcmp(extLowerCase, ".qt") == 0 || strcmp(extLowerCase, ".mov") == 0) return "video/quicktime";
-
-  return NULL;
+  return MimeTypes::get(name);
 }
 
 /***********************************************************************
@@ -880,12 +1042,13 @@ const char* WebServer::get_mime_type(const char *name)
 * @param messageType - client socket descriptor
 * @param len - HTTP message type
 * @param keepAlive 
-* @param zipped - true is content will be compressed
+* @param contentEncoding - the content coding name, or NULL
 * @param response - the HttpResponse
+* @param varyAcceptEncoding - true if the content depends on the Accept-Encoding header
 * \return result of send function (successfull: >=0, otherwise <0)
 ***********************************************************************/
 
-std::string WebServer::getHttpHeader(const char *messageType, const size_t len, const bool keepAlive, const bool zipped, HttpResponse* response)
+std::string WebServer::getHttpHeader(const char *messageType, const size_t len, const bool keepAlive, const char *contentEncoding, HttpResponse* response, const bool varyAcceptEncoding)
 {
   char timeBuf[200];
   time_t rawtime;
@@ -912,6 +1075,12 @@ std::string WebServer::getHttpHeader(const char *messageType, const size_t len,
       else header+="false\r\n";
     } 
 
+    if ( response->getETag().size() )
+      header+="ETag: " + response->getETag() + "\r\n";
+
+    if ( response->getCacheControl().size() )
+      header+="Cache-Control: " + response->getCacheControl() + "\r\n";
+
     std::vector<std::string>& cookies=response->getCookies();
     for (unsigned i=0; i < cookies.size(); i++)
       header+="Set-Cookie: " + cookies[i] + "\r\n";
@@ -929,8 +1098,11 @@ std::string WebServer::getHttpHeader(const char *messageType, const size_t len,
     mimetype=response->getMimeType();
   header+="Content-Type: "+ mimetype  + "\r\n";
   
-  if (zipped)
-    header+="Content-Encoding: gzip\r\n";
+  if (contentEncoding != NULL)
+    header+="Content-Encoding: "+std::string(contentEncoding)+"\r\n";
+
+  if (varyAcceptEncoding)
+    header+="Vary: Accept-Encoding\r\n";
   
   if (len)
   {
@@ -944,6 +1116,49 @@ std::string WebServer::getHttpHeader(const char *messageType, const size_t len,
 }
 
 
+/***********************************************************************
+* isETagMatching: weak comparison of the If-None-Match entity tags (rfc7232)
+* @param ifNoneMatch - the If-None-Match header value
+* @param etag - the entity tag of the representation
+* \return true if one entity tag matches, or for "*"
+***********************************************************************/
+
+bool WebServer::isETagMatching(const char *ifNoneMatch, const std::string& etag)
+{
+  const char *tag=etag.c_str();
+  if (strncmp(tag, "W/", 2) == 0) tag+=2;
+  size_t tagLen=strlen(tag);
+
+  const char *p=ifNoneMatch;
+  while (*p)
+  {
+    while (*p == ' ' || *p == '\t' || *p == ',') p++;
+    if (*p == '*') return true;
+    if (strncmp(p, "W/", 2) == 0) p+=2;
+
+    const char *start=p;
+    while (*p && *p != ',' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+    if ((size_t)(p-start) == tagLen && strncmp(start, tag, tagLen) == 0)
+      return true;
+    while (*p && *p != ',') p++;
+  }
+  return false;
+}
+
+/***********************************************************************
+* codedETag: entity tag of a content coded by the webserver
+* @param etag - the quoted entity tag of the content
+* @param coding - the content coding name
+* \return the entity tag of the coded representation
+***********************************************************************/
+
+std::string WebServer::codedETag(const std::string& etag, const std::string& coding)
+{
+  if (etag.size() < 2 || etag[etag.size()-1] != '"')
+    return etag+"-"+coding;
+  return etag.substr(0, etag.size()-1)+"-"+coding+"\"";
+}
+
 /**********************************************************************
 * getNoContentErrorMsg: send a 204 No Content Message
 * \return the http message to send
@@ -1039,6 +1254,23 @@ u_short WebServer::init()
 
   //threadWebServer=0;
   nbServerSock=0;
+
+  if (useInheritedSockets())
+  {
+    initSocketsHandoff();
+
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname(server_sock[0], (struct sockaddr*)&addr, &addrLen) == 0)
+    {
+      if (addr.ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+      if (addr.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    }
+    return ( tcpPort );
+  }
+
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
   hints.ai_socktype = SOCK_STREAM; /* TCP socket */
@@ -1087,6 +1319,7 @@ u_short WebServer::init()
     if ( bind( server_sock[ nbServerSock ], rp->ai_addr, rp->ai_addrlen) == 0 )
       if ( listen(server_sock [ nbServerSock ], 128) >= 0 )
       {
+        setSocketNonBlocking( server_sock [ nbServerSock ] );
         nbServerSock ++;                  /* Success */
         continue;
       }
@@ -1098,9 +1331,194 @@ u_short WebServer::init()
   if (nbServerSock == 0)
     fatalError("WebServer : Init Failed ! (nbServerSock == 0)");
 
+  initSocketsHandoff();
+
   return ( tcpPort );
 }
 
+/***********************************************************************
+* useInheritedSockets: Use the listening sockets given by systemd
+*                      (LISTEN_FDS) or by a previous process
+* \return true if at least one inherited socket is used
+***********************************************************************/
+
+bool WebServer::useInheritedSockets()
+{
+  const char *listenPid=getenv("LISTEN_PID"), *listenFds=getenv("LISTEN_FDS");
+  if ( listenPid != NULL && listenFds != NULL && (pid_t)atoi(listenPid) == getpid() )
+  {
+    int nb=atoi(listenFds);
+    for (int fd=SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + nb; fd++)
+      inheritedSockets.push_back(fd);
+
+    // don't pass them to our children
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+  }
+
+  for (std::vector<int>::const_iterator it=inheritedSockets.begin(); it!=inheritedSockets.end(); it++)
+  {
+    if (!isListeningSocket(*it))
+    {
+      char buf[100]; snprintf(buf, 100, "WebServer : inherited descriptor %d isn't a listening socket", *it);
+      NVJ_LOG->append(NVJ_WARNING, buf);
+      continue;
+    }
+
+    if (nbServerSock == NVJ_MAX_SERVER_SOCK)
+    {
+      NVJ_LOG->append(NVJ_WARNING, "WebServer : too many inherited sockets, ignoring the others");
+      break;
+    }
+
+    setSocketCloseOnExec(*it);
+    setSocketNonBlocking(*it);
+    server_sock[ nbServerSock++ ] = *it;
+  }
+  inheritedSockets.clear();
+
+  if (nbServerSock)
+  {
+    char buf[100]; snprintf(buf, 100, "WebServer : Using %d inherited listening socket(s)", (int)nbServerSock);
+    NVJ_LOG->append(NVJ_INFO, buf);
+    serverSockShared=true;
+  }
+
+  return nbServerSock > 0;
+}
+
+/***********************************************************************
+* inheritListeningSockets: Receive the listening sockets of a running
+*                          webserver (see setSocketsHandoffPath)
+* @param path - the AF_UNIX socket path
+* \return true if at least one socket has been received
+***********************************************************************/
+
+bool WebServer::inheritListeningSockets(const std::string& path)
+{
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path))
+    return false;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  int sock=socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    return false;
+
+  if ( connect(sock, (struct sockaddr*)&addr, sizeof addr) != 0 )
+  {
+    NVJ_LOG->append(NVJ_DEBUG, "WebServer : no running server on handoff path '"+path+"'");
+    close(sock);
+    return false;
+  }
+
+  if (!isSocketPeerUser(sock))
+  {
+    NVJ_LOG->append(NVJ_ERROR, "WebServer : the server on handoff path '"+path+"' doesn't run as our user");
+    close(sock);
+    return false;
+  }
+
+  // a hung previous process must not block our startup: the tcp ports are bound then
+  int fds[ NVJ_MAX_SERVER_SOCK ];
+  size_t nb=recvSocketDescriptors(sock, fds, NVJ_MAX_SERVER_SOCK, SOCKETS_HANDOFF_TIMEOUT);
+  close(sock);
+
+  if (!nb)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "WebServer : no listening socket received on handoff path '"+path+"'");
+    return false;
+  }
+
+  for (size_t i=0; i<nb; i++)
+    inheritedSockets.push_back(fds[i]);
+
+  char buf[100]; snprintf(buf, 100, "WebServer : %d listening socket(s) received from the previous process", (int)nb);
+  NVJ_LOG->append(NVJ_INFO, buf);
+
+  return nb > 0;
+}
+
+/***********************************************************************
+* initSocketsHandoff: Listen on the handoff path, if any
+***********************************************************************/
+
+void WebServer::initSocketsHandoff()
+{
+  struct sockaddr_un addr;
+  if (!socketsHandoffPath.size())
+    return;
+
+  if (socketsHandoffPath.size() >= sizeof(addr.sun_path))
+  {
+    NVJ_LOG->append(NVJ_ERROR, "WebServer : sockets handoff path is too long");
+    return;
+  }
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socketsHandoffPath.c_str());
+  unlink(socketsHandoffPath.c_str());
+
+  if ( (socketsHandoffSock=socket(AF_UNIX, SOCK_STREAM, 0)) == -1 )
+    return;
+
+  if ( bind(socketsHandoffSock, (struct sockaddr*)&addr, sizeof addr) != 0
+    || listen(socketsHandoffSock, 4) != 0 )
+  {
+    NVJ_LOG->append(NVJ_ERROR, std::string("WebServer : can't listen on sockets handoff path - ") + strerror(errno) );
+    close(socketsHandoffSock);
+    socketsHandoffSock=-1;
+    return;
+  }
+  setSocketCloseOnExec(socketsHandoffSock);
+  setSocketNonBlocking(socketsHandoffSock);
+}
+
+/***********************************************************************
+* serveSocketsHandoff: Pass our listening sockets to the next process
+***********************************************************************/
+
+void WebServer::serveSocketsHandoff()
+{
+  int sock=accept(socketsHandoffSock, NULL, NULL);
+  if (sock == -1)
+    return;
+
+  // the listening sockets are only given to our user
+  if (!isSocketPeerUser(sock))
+  {
+    NVJ_LOG->append(NVJ_ERROR, "WebServer : sockets handoff refused to a process of another user");
+    close(sock);
+    return;
+  }
+
+  setSocketNonBlocking(sock, false);
+
+  int fds[ NVJ_MAX_SERVER_SOCK ];
+  size_t nb=nbServerSock;
+  for (size_t i=0; i<nb; i++)
+    fds[i]=server_sock[i];
+
+  if (sendSocketDescriptors(sock, fds, nb))
+  {
+    NVJ_LOG->append(NVJ_INFO, "WebServer : Listening sockets handed over to the next process");
+    serverSockShared=true;
+
+    // the next process now owns the handoff path
+    close(socketsHandoffSock);
+    socketsHandoffSock=-1;
+  }
+  else
+    NVJ_LOG->append(NVJ_ERROR, std::string("WebServer : Listening sockets handoff failed - ") + strerror(errno) );
+
+  close(sock);
+}
+
 
 /***********************************************************************
 * exit: Stop http server
@@ -1116,9 +1534,20 @@ void WebServer::exit()
 
   while (nbServerSock>0)
   {
-    shutdown ( server_sock[ --nbServerSock ], 2 ) ;
+    // a shared listening socket must stay open for the other process
+    if (!serverSockShared)
+      shutdown ( server_sock[ --nbServerSock ], 2 ) ;
+    else
+      --nbServerSock;
     close (server_sock[ nbServerSock ]);
   }
+
+  if (socketsHandoffSock != -1)
+  {
+    close(socketsHandoffSock);
+    unlink(socketsHandoffPath.c_str());
+    socketsHandoffSock=-1;
+  }
   pthread_mutex_unlock( &clientsQueue_mutex );
 }
 
@@ -1360,7 +1789,7 @@ void WebServer::threadProcessing()
   NVJ_LOG->append(NVJ_DEBUG,buf);
 
   struct pollfd *pfd;
-  if ( (pfd = (pollfd *)malloc( nbServerSock * sizeof( struct pollfd ) )) == NULL )
+  if ( (pfd = (pollfd *)malloc( (nbServerSock + 1) * sizeof( struct pollfd ) )) == NULL )
       fatalError("WebServer : malloc error ");
 
   unsigned idx;
@@ -1373,14 +1802,26 @@ void WebServer::threadProcessing()
       pfd[ idx ].revents = 0;
   }
 
+  // the last entry is the sockets handoff path (ignored if negative)
+  const unsigned handoffIdx = nbServerSock;
+  pfd[ handoffIdx ].fd = socketsHandoffSock;
+  pfd[ handoffIdx ].events  = POLLIN;
+  pfd[ handoffIdx ].revents = 0;
+
   for (;!exiting;)
   {
     do
     {
-      status = poll( pfd, nbServerSock, 500 );
+      status = poll( pfd, handoffIdx + 1, 500 );
     }
     while ( ( status < 0 ) && ( errno == EINTR ) && !exiting );
 
+    if ( !exiting && socketsHandoffSock != -1 && (pfd[ handoffIdx ].revents & POLLIN) )
+    {
+      serveSocketsHandoff();
+      pfd[ handoffIdx ].fd = socketsHandoffSock;
+    }
+
     for ( idx = 0; idx < nbServerSock && !exiting; idx++ )
     {
 
@@ -1390,6 +1831,11 @@ void WebServer::threadProcessing()
       client_sock = accept(pfd[idx].fd,
                        (struct sockaddr*)&clientAddress, &clientAddressLength);
 
+      // listening sockets are non blocking: the connection may have been taken
+      // by another process sharing the socket
+      if ( client_sock == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+        continue;
+
       IpAddress webClientAddr;
               
       if ( clientAddress.ss_family == AF_INET )
@@ -1421,6 +1867,7 @@ void WebServer::threadProcessing()
         NVJ_LOG->appendUniq(NVJ_ERROR, "WebServer : An error occurred when attempting to access the socket (accept == -1)");
       else
       {
+        setSocketNonBlocking(client_sock, false);
         if (!setSocketSndRcvTimeout(client_sock, 1, 0))
           NVJ_LOG->appendUniq(NVJ_ERROR, std::string("WebServer : setSocketSndRcvTimeout error - ") + strerror(errno) );
         if (!setSocketNoSigpipe(client_sock))
@@ -16,10 +16,21 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <vector>
 #include <string>
+#include <map>
+#include <set>
 #include <algorithm>
 
+#include "libnavajo/nvjGzip.h"
+#include "libnavajo/nvjThread.h"
+#include "libnavajo/WebServer.hh"
+#include "libnavajo/PrecompiledRepository.hh"
+#include "libnavajo/BundleRepository.hh"
+
 void dump_buffer(FILE *f, unsigned n, const unsigned char* buf)
 {
   int cptLine = 0;
@@ -59,12 +70,606 @@ char * str_replace_first(char * buffer, const char * s, const char * by)
   return ret;
 }
 
-typedef struct
+/**
+* an asset: a file of the directory, and its variants
+*/
+struct Asset
+{
+  std::string filename;          // relative to the directory
+  std::string url;
+  bool gzSource;                 // a gzip file, served as its uncompressed url
+  long long fileSize, mtime;
+  unsigned long long fileHash;   // hash of the file content
+  unsigned long long hash;       // hash of the served content (etag)
+  size_t length, gzipLength;
+  unsigned char *data, *gzipData;
+  bool reused;                   // unchanged since the previous build
+};
+
+#define BLOB_SYMBOL "nvj_precompiled_blob"
+#define BLOB_ALIGN 16
+#define MANIFEST_HEADER "# navajoPrecompiler manifest 1"
+
+bool precompress = true;
+const char *blobPath = NULL;
+const char *bundlePath = NULL;
+const char *fingerprintManifest = NULL;
+std::string directory, outDir;
+
+std::vector< Asset > assets;
+std::set< std::string > filenamesSet;
+std::map< std::string, Asset > manifest;
+volatile size_t nextAsset = 0;
+
+/**********************************************************************/
+/**
+* the name of the arrays and cache files of an asset: a same content
+* shares them, whatever its url
+*/
+std::string asset_key(const Asset& a)
+{
+  char key[48];
+  snprintf(key, sizeof key, "asset_%016llx%s%s", a.fileHash, a.gzSource ? "_z" : "", precompress ? "" : "_n");
+  return key;
+}
+
+std::string cache_path(const Asset& a, const char* ext)
+{
+  return outDir + "/cache/" + asset_key(a) + ext;
+}
+
+bool file_exists(const std::string& path)
+{
+  struct stat s;
+  return stat(path.c_str(), &s) == 0;
+}
+
+/**********************************************************************/
+/**
+* the outputs are written in a temporary file, and replace the previous
+* ones only if they differ: the unchanged sources are not recompiled
+*/
+FILE* open_output(const std::string& path)
+{
+  FILE *f = fopen((path + ".tmp").c_str(), "wb");
+  if (f == NULL)
+  {
+    fprintf(stderr, "ERROR: can't write the file '%s' !\n", path.c_str());
+    exit(EXIT_FAILURE);
+  }
+  return f;
+}
+
+bool same_content(const std::string& path1, const std::string& path2)
+{
+  FILE *f1 = fopen(path1.c_str(), "rb"), *f2 = fopen(path2.c_str(), "rb");
+  bool same = f1 != NULL && f2 != NULL;
+  while (same)
+  {
+    char buf1[65536], buf2[65536];
+    size_t n1 = fread(buf1, 1, sizeof buf1, f1), n2 = fread(buf2, 1, sizeof buf2, f2);
+    if (n1 != n2 || memcmp(buf1, buf2, n1)) same = false;
+    if (!n1) break;
+  }
+  if (f1 != NULL) fclose(f1);
+  if (f2 != NULL) fclose(f2);
+  return same;
+}
+
+void close_output(FILE *f, const std::string& path)
+{
+  std::string tmpPath = path + ".tmp";
+  if (fclose(f) != 0)
+  {
+    fprintf(stderr, "ERROR: can't write the file '%s' !\n", path.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  if (same_content(tmpPath, path))
+    unlink(tmpPath.c_str());
+  else
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+    {
+      perror("rename");
+      exit(EXIT_FAILURE);
+    }
+}
+
+/**********************************************************************/
+/**
+* read a whole file
+* @return the content (to free), NULL if failed
+*/
+unsigned char* read_file(const std::string& path, size_t *size)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return NULL;
+
+  struct stat s;
+  unsigned char *buffer = NULL;
+  if (fstat(fd, &s) == 0 && (buffer = (unsigned char*) malloc(s.st_size + 1)) != NULL)
+  {
+    size_t len = 0;
+    ssize_t n;
+    while (len < (size_t)s.st_size && (n = read(fd, buffer + len, s.st_size - len)) > 0)
+      len += n;
+    if (len != (size_t)s.st_size)
+    {
+      free (buffer);
+      buffer = NULL;
+    }
+    *size = len;
+  }
+
+  close(fd);
+  return buffer;
+}
+
+/**********************************************************************/
+/**
+* output the arrays of an asset
+* @param f: the output file
+* @param a: the asset, with its variants
+* @param shared: declare the arrays extern (multiple translation units mode)
+*/
+void emit_arrays(FILE *f, const Asset& a, bool shared)
+{
+  std::string key = asset_key(a);
+  const unsigned char *bufs[2] = { a.data, a.gzipData };
+  size_t lens[2] = { a.length, a.gzipLength };
+  const char *suffixes[2] = { "", "_gz" };
+
+  for (int v = 0; v < 2; v++)
+  {
+    if (v && bufs[v] == NULL) break;
+    if (shared)
+      fprintf (f, "  extern const unsigned char %s%s[];\n", key.c_str(), suffixes[v]);
+    fprintf (f, "  %sconst unsigned char %s%s[] =\n", shared ? "" : "static ", key.c_str(), suffixes[v]);
+    fprintf (f, "  {\n" );
+    dump_buffer(f, lens[v], bufs[v]);
+    fprintf (f, "\n  };\n\n");
+  }
+}
+
+/**********************************************************************/
+/**
+* output the assembly stub linking the blob file into the read-only data
+* @param f: the output file
+* @param blobSize: the blob size
+*/
+void emit_blob_stub(FILE *f, size_t blobSize)
+{
+  fprintf (f, "// assets packed in \"%s\" (%lu bytes)\n", blobPath, (unsigned long)blobSize);
+  fprintf (f, "__asm__(\n");
+  fprintf (f, "#ifdef __APPLE__\n");
+  fprintf (f, "  \".const_data\\n\"\n");
+  fprintf (f, "  \".globl _" BLOB_SYMBOL "\\n\"\n");
+  fprintf (f, "  \".p2align 12\\n\"\n");
+  fprintf (f, "  \"_" BLOB_SYMBOL ":\\n\"\n");
+  fprintf (f, "  \".incbin \\\"%s\\\"\\n\"\n", blobPath);
+  fprintf (f, "  \".text\\n\"\n");
+  fprintf (f, "#else\n");
+  fprintf (f, "  \".section .rodata\\n\"\n");
+  fprintf (f, "  \".global " BLOB_SYMBOL "\\n\"\n");
+  fprintf (f, "  \".type " BLOB_SYMBOL ", @object\\n\"\n");
+  fprintf (f, "  \".balign 4096\\n\"\n");
+  fprintf (f, "  \"" BLOB_SYMBOL ":\\n\"\n");
+  fprintf (f, "  \".incbin \\\"%s\\\"\\n\"\n", blobPath);
+  fprintf (f, "  \".size " BLOB_SYMBOL ", %lu\\n\"\n", (unsigned long)blobSize);
+  fprintf (f, "  \".previous\\n\"\n");
+  fprintf (f, "#endif\n");
+  fprintf (f, ");\n\n");
+  fprintf (f, "extern \"C\" const unsigned char " BLOB_SYMBOL "[];\n\n");
+}
+
+/**********************************************************************/
+/**
+* write a content in the blob, aligned
+* @return its offset
+*/
+size_t write_blob(FILE *blobFile, size_t *blobSize, const unsigned char* buf, size_t len)
+{
+  static const unsigned char padding[BLOB_ALIGN] = { 0 };
+  size_t pad = (BLOB_ALIGN - *blobSize % BLOB_ALIGN) % BLOB_ALIGN;
+  if ( (pad && fwrite(padding, 1, pad, blobFile) != pad) || fwrite(buf, 1, len, blobFile) != len )
+  {
+    perror("blob write");
+    exit(EXIT_FAILURE);
+  }
+  size_t offset = *blobSize + pad;
+  *blobSize = offset + len;
+  return offset;
+}
+
+struct BucketSizeCmp
+{
+  const std::vector< std::vector<size_t> >& buckets;
+  BucketSizeCmp(const std::vector< std::vector<size_t> >& b) : buckets(b) {};
+  bool operator()(size_t a, size_t b) const { return buckets[a].size() > buckets[b].size(); };
+};
+
+/**********************************************************************/
+/**
+* FNV-1a 64 bits hash, used for the strong entity tags
+*/
+unsigned long long fnv1a64(const unsigned char* buf, size_t len)
+{
+  unsigned long long h=14695981039346656037ULL;
+  for (size_t i=0; i<len; i++)
+    h = (h ^ buf[i]) * 1099511628211ULL;
+  return h;
+}
+
+/**********************************************************************/
+/**
+* build a minimal perfect hash table (hash and displace): the keys are
+* dispatched in nbKeys buckets; for each bucket, from the biggest one, a seed
+* is searched so that its keys fall in free slots. The buckets with only one
+* key directly get a free slot, stored as -slot-1.
+* @param keys: the urls (distinct)
+* @param displacements: set to the seed or slot of each bucket
+* @param slots: set to the key index of each slot
+*/
+void buildPerfectHash(const std::vector<std::string>& keys, std::vector<int>& displacements, std::vector<size_t>& slots)
+{
+  size_t n=keys.size();
+  std::vector< std::vector<size_t> > buckets(n);
+  for (size_t i=0; i<n; i++)
+    buckets[PrecompiledRepository::hash(0, keys[i].c_str(), keys[i].size()) % n].push_back(i);
+
+  std::vector<size_t> order(n);
+  for (size_t b=0; b<n; b++) order[b]=b;
+  std::stable_sort(order.begin(), order.end(), BucketSizeCmp(buckets));
+
+  displacements.assign(n, 0);
+  slots.assign(n, (size_t)-1);
+
+  size_t o=0;
+  for (; o<n && buckets[order[o]].size() > 1; o++)
+  {
+    const std::vector<size_t>& bucket=buckets[order[o]];
+    std::vector<size_t> bucketSlots(bucket.size());
+    for (unsigned d=1; ; d++)
+    {
+      if (d > 0x7FFFFFFF)
+      {
+        fprintf(stderr, "ERROR: can't build the perfect hash table !\n");
+        exit(EXIT_FAILURE);
+      }
+
+      size_t k=0;
+      for (; k<bucket.size(); k++)
+      {
+        size_t slot=PrecompiledRepository::hash(d, keys[bucket[k]].c_str(), keys[bucket[k]].size()) % n;
+        if (slots[slot] != (size_t)-1 || std::find(bucketSlots.begin(), bucketSlots.begin()+k, slot) != bucketSlots.begin()+k)
+          break;
+        bucketSlots[k]=slot;
+      }
+      if (k == bucket.size())
+      {
+        for (k=0; k<bucket.size(); k++)
+          slots[bucketSlots[k]]=bucket[k];
+        displacements[order[o]]=(int)d;
+        break;
+      }
+    }
+  }
+
+  size_t freeSlot=0;
+  for (; o<n && buckets[order[o]].size() == 1; o++)
+  {
+    while (slots[freeSlot] != (size_t)-1) freeSlot++;
+    slots[freeSlot]=buckets[order[o]][0];
+    displacements[order[o]]=-(int)freeSlot-1;
+  }
+}
+
+/**********************************************************************/
+/**
+* compress with the best zlib ratio: level 9, and the smallest result of
+* the default and filtered strategies
+* @return the compressed length (0 if failed)
+*/
+size_t gzip_best(unsigned char** dst, const unsigned char* src, const size_t sizeSrc)
+{
+  const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED };
+  size_t bestLen=0;
+  *dst=NULL;
+
+  for (size_t i=0; i<sizeof strategies / sizeof(int); i++)
+  {
+    unsigned char *gz=NULL;
+    size_t gzLen=0;
+    try
+    {
+      gzLen=nvj_gzip(&gz, src, sizeSrc, false, Z_BEST_COMPRESSION, strategies[i]);
+    }
+    catch (...)
+    {
+      continue;
+    }
+
+    if (*dst == NULL || gzLen < bestLen)
+    {
+      free (*dst);
+      *dst=gz;
+      bestLen=gzLen;
+    }
+    else
+      free (gz);
+  }
+
+  return bestLen;
+}
+
+/**********************************************************************/
+/**
+* a gzip file without its uncompressed counterpart is served as the
+* uncompressed url
+*/
+bool is_gzip_source(const std::string& filename)
+{
+  size_t gzExt=filename.size() > 3 ? filename.size() - 3 : 0;
+  return gzExt && filename.compare(gzExt, 3, ".gz") == 0 && !filenamesSet.count(filename.substr(0, gzExt));
+}
+
+/**********************************************************************/
+/**
+* set the variants of an asset from its file content
+* @param a: the asset
+* @param buffer: the file content (kept or freed)
+* @param size: the file length
+*/
+void encode_asset(Asset& a, unsigned char* buffer, size_t size)
+{
+  a.gzSource = false;
+  a.url = a.filename;
+  a.data = buffer;
+  a.length = size;
+  a.gzipData = NULL;
+  a.gzipLength = 0;
+
+  if (is_gzip_source(a.filename))
+  {
+    unsigned char *unzipped = NULL;
+    size_t unzippedSize = 0;
+    try
+    {
+      unzippedSize = nvj_gunzip(&unzipped, buffer, size);
+    }
+    catch (...)
+    {
+      unzipped = NULL;
+    }
+
+    if (unzipped != NULL)
+    {
+      a.gzSource = true;
+      a.url = a.filename.substr(0, a.filename.size() - 3);
+      a.gzipData = buffer;
+      a.gzipLength = size;
+      a.data = unzipped;
+      a.length = unzippedSize;
+    }
+  }
+  else
+    if (precompress && size)
+    {
+      a.gzipLength = gzip_best(&a.gzipData, buffer, size);
+      if (a.gzipData != NULL && a.gzipLength >= size)
+      {
+        free (a.gzipData);
+        a.gzipData = NULL;
+      }
+      if (a.gzipData == NULL)
+        a.gzipLength = 0;
+    }
+
+  a.hash = fnv1a64(a.data, a.length);
+}
+
+/**********************************************************************/
+/**
+* reload the variants of an unchanged asset (blob mode)
+*/
+void load_asset(Asset& a)
+{
+  size_t size;
+  unsigned char *buffer = read_file(directory + '/' + a.filename, &size);
+  if (buffer == NULL)
+  { fprintf(stderr, "ERROR: can't read file: %s\n", a.filename.c_str()); exit (1); }
+
+  if (!a.gzSource)
+  {
+    a.data = buffer;
+    a.length = size;
+    if (a.gzipLength && (a.gzipData = read_file(cache_path(a, ".gz"), &a.gzipLength)) == NULL)
+    { fprintf(stderr, "ERROR: can't read the cache of: %s\n", a.filename.c_str()); exit (1); }
+    return;
+  }
+
+  a.gzipData = buffer;
+  a.gzipLength = size;
+  a.length = nvj_gunzip(&a.data, buffer, size);
+}
+
+void release_asset(Asset& a)
+{
+  free (a.data);
+  free (a.gzipData);
+  a.data = a.gzipData = NULL;
+}
+
+/**********************************************************************/
+/**
+* is the output of a previous build still available ?
+*/
+bool is_cached(const Asset& m)
 {
-  std::string* URL;
-  std::string* varName;
-  size_t length;
-}  ConversionEntry;
+  if (outDir.empty())
+    return false;
+  if (blobPath == NULL && bundlePath == NULL)
+    return file_exists(cache_path(m, ".inc"));
+  return m.gzSource || !m.gzipLength || file_exists(cache_path(m, ".gz"));
+}
+
+/**********************************************************************/
+/**
+* read, hash and encode an asset, unless its content didn't change since
+* the previous build: same size and modification time, or same hash.
+* In multiple translation units mode, the encoded variants are cached.
+*/
+void process_asset(Asset& a, size_t index)
+{
+  std::string path = directory + '/' + a.filename;
+  struct stat s;
+  if (stat(path.c_str(), &s) == -1)
+  { fprintf(stderr, "ERROR: can't read file: %s\n", a.filename.c_str()); exit (1); }
+
+  a.fileSize = s.st_size;
+#ifdef LINUX
+  a.mtime = s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+#else
+  a.mtime = s.st_mtime * 1000000000LL;
+#endif
+
+  std::map< std::string, Asset >::const_iterator it = manifest.find(a.filename);
+  const Asset *previous = it != manifest.end() && it->second.gzSource == is_gzip_source(a.filename)
+                          && is_cached(it->second) ? &it->second : NULL;
+
+  if (previous != NULL && previous->fileSize == a.fileSize && previous->mtime == a.mtime)
+    a.fileHash = previous->fileHash;
+  else
+  {
+    size_t size;
+    unsigned char *buffer = read_file(path, &size);
+    if (buffer == NULL)
+    { fprintf(stderr, "ERROR: can't read file: %s\n", a.filename.c_str()); exit (1); }
+    a.fileHash = fnv1a64(buffer, size);
+
+    if (previous == NULL || previous->fileHash != a.fileHash)
+    {
+      encode_asset(a, buffer, size);
+      a.reused = false;
+    }
+    else
+      free (buffer);
+  }
+
+  if (a.reused)
+  {
+    a.gzSource = previous->gzSource;
+    a.url = a.gzSource ? a.filename.substr(0, a.filename.size() - 3) : a.filename;
+    a.hash = previous->hash;
+    a.length = previous->length;
+    a.gzipLength = previous->gzipLength;
+    return;
+  }
+
+  if (outDir.empty())
+    return;
+
+  // cache the encoded variants (a same content may be encoded concurrently)
+  char tmpExt[32];
+  if (blobPath == NULL && bundlePath == NULL)
+  {
+    snprintf(tmpExt, sizeof tmpExt, ".inc.%lu", (unsigned long)index);
+    FILE *f = fopen(cache_path(a, tmpExt).c_str(), "wb");
+    if (f == NULL)
+    { fprintf(stderr, "ERROR: can't write the cache of: %s\n", a.filename.c_str()); exit (1); }
+    emit_arrays(f, a, true);
+    if (fclose(f) != 0 || rename(cache_path(a, tmpExt).c_str(), cache_path(a, ".inc").c_str()) == -1)
+    { fprintf(stderr, "ERROR: can't write the cache of: %s\n", a.filename.c_str()); exit (1); }
+    release_asset(a);
+  }
+  else
+    if (!a.gzSource && a.gzipLength)
+    {
+      snprintf(tmpExt, sizeof tmpExt, ".gz.%lu", (unsigned long)index);
+      FILE *f = fopen(cache_path(a, tmpExt).c_str(), "wb");
+      if (f == NULL || fwrite(a.gzipData, 1, a.gzipLength, f) != a.gzipLength
+          || fclose(f) != 0 || rename(cache_path(a, tmpExt).c_str(), cache_path(a, ".gz").c_str()) == -1)
+      { fprintf(stderr, "ERROR: can't write the cache of: %s\n", a.filename.c_str()); exit (1); }
+    }
+}
+
+void* process_assets(void *)
+{
+  size_t i;
+  while ( (i=__sync_fetch_and_add(&nextAsset, 1)) < assets.size() )
+    process_asset(assets[i], i);
+  return NULL;
+}
+
+/**********************************************************************/
+/**
+* the manifest: for each file of the previous build, its size,
+* modification time, content hash, and the metadata of its variants
+*/
+void load_manifest()
+{
+  FILE *f = fopen((outDir + "/navajo.manifest").c_str(), "r");
+  if (f == NULL) return;
+
+  char line[8192];
+  if (fgets(line, sizeof line, f) == NULL || strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)))
+  {
+    fclose(f);
+    return;
+  }
+
+  while (fgets(line, sizeof line, f) != NULL)
+  {
+    Asset m;
+    unsigned long length, gzipLength;
+    int gzSource, pos = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%llx %lld %lld %llx %lu %lu %d %n", &m.fileHash, &m.fileSize, &m.mtime,
+               &m.hash, &length, &gzipLength, &gzSource, &pos) != 7 || !pos || !line[pos])
+      continue;
+    m.filename = line + pos;
+    m.length = length;
+    m.gzipLength = gzipLength;
+    m.gzSource = gzSource != 0;
+    manifest[m.filename] = m;
+  }
+  fclose(f);
+}
+
+void save_manifest()
+{
+  std::string path = outDir + "/navajo.manifest";
+  FILE *f = open_output(path);
+  fprintf (f, MANIFEST_HEADER "\n");
+  for (size_t i = 0; i < assets.size(); i++)
+  {
+    const Asset& a = assets[i];
+    fprintf (f, "%016llx %lld %lld %016llx %lu %lu %d %s\n", a.fileHash, a.fileSize, a.mtime, a.hash,
+             (unsigned long)a.length, (unsigned long)a.gzipLength, a.gzSource ? 1 : 0, a.filename.c_str());
+  }
+  close_output(f, path);
+}
+
+/**********************************************************************/
+/**
+* remove the cached variants which are no longer used
+*/
+void clean_cache(const std::set<std::string>& keys)
+{
+  std::string cacheDir = outDir + "/cache";
+  DIR *dir = opendir (cacheDir.c_str());
+  if (dir == NULL) return;
+
+  struct dirent *entry;
+  while ((entry = readdir (dir)) != NULL)
+  {
+    std::string name = entry->d_name;
+    if (name.compare(0, 6, "asset_") || keys.count(name.substr(0, name.find('.'))))
+      continue;
+    unlink((cacheDir + '/' + name).c_str());
+  }
+  closedir (dir);
+}
 
 std::vector< std::string > filenamesVec;
 
@@ -122,6 +727,257 @@ void parseDirectory( const std::string& dirPath )
     return ;
 }
 
+/**********************************************************************/
+/**
+* JSON string
+*/
+std::string json_string(const std::string& str)
+{
+  std::string json="\"";
+  for (size_t i = 0; i < str.size(); i++)
+  {
+    if ((unsigned char)str[i] < 0x20)
+    {
+      char esc[8];
+      snprintf(esc, sizeof esc, "\\u%04x", (unsigned char)str[i]);
+      json+=esc;
+      continue;
+    }
+    if (str[i] == '"' || str[i] == '\\')
+      json+='\\';
+    json+=str[i];
+  }
+  return json+'"';
+}
+
+/**********************************************************************/
+/**
+* build the pages, the assets and their fingerprinted aliases, indexed by a
+* minimal perfect hash table, and write the fingerprints lookup manifest
+* @param urls: set to the urls of the pages (the assets, then the aliases)
+* @param fingerprintedUrls: set to the fingerprinted url of each asset
+* @param displacements: set to the displacements of the perfect hash table
+* @param slots: set to the page index of each slot
+*/
+void build_pages(std::vector<std::string>& urls, std::vector<std::string>& fingerprintedUrls,
+                 std::vector<int>& displacements, std::vector<size_t>& slots)
+{
+  for (size_t i = 0; i < assets.size(); i++)
+  {
+    urls.push_back(assets[i].url);
+    if (fingerprintManifest != NULL)
+    {
+      char fingerprint[FINGERPRINT_LENGTH + 1];
+      snprintf(fingerprint, sizeof fingerprint, "%0*llx", FINGERPRINT_LENGTH, assets[i].hash >> (64 - 4*FINGERPRINT_LENGTH));
+      fingerprintedUrls.push_back(WebRepository::fingerprintUrl(assets[i].url, fingerprint));
+    }
+  }
+  urls.insert(urls.end(), fingerprintedUrls.begin(), fingerprintedUrls.end());
+
+  std::vector<std::string> sortedUrls(urls);
+  std::sort(sortedUrls.begin(), sortedUrls.end());
+  std::vector<std::string>::iterator dup=std::adjacent_find(sortedUrls.begin(), sortedUrls.end());
+  if (dup != sortedUrls.end())
+  {
+    fprintf(stderr, "ERROR: duplicate url '%s' !\n", dup->c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  buildPerfectHash(urls, displacements, slots);
+
+  // the lookup manifest of the fingerprinted urls, for the templates
+  if (fingerprintManifest != NULL)
+  {
+    FILE *m = open_output(fingerprintManifest);
+    fprintf (m, "{");
+    for (size_t i = 0; i < assets.size(); i++)
+      fprintf (m, "%s\n  %s: %s", i ? "," : "", json_string(assets[i].url).c_str(), json_string(fingerprintedUrls[i]).c_str());
+    fprintf (m, "\n}\n");
+    close_output(m, fingerprintManifest);
+  }
+}
+
+/**********************************************************************/
+/**
+* output the pages table and the perfect hash table
+* @param f: the output file
+* @param dataExprs, gzipExprs: the C++ expressions of the variants addresses
+*/
+void emit_index(FILE *f, const std::vector<std::string>& dataExprs, const std::vector<std::string>& gzipExprs)
+{
+  std::vector<std::string> urls, fingerprintedUrls;
+  std::vector<int> displacements;
+  std::vector<size_t> slots;
+  build_pages(urls, fingerprintedUrls, displacements, slots);
+
+  fprintf (f, "std::string PrecompiledRepository::location;\n\n");
+  fprintf (f, "const PrecompiledRepository::WebStaticPage PrecompiledRepository::pages[] =\n{\n");
+
+  for (size_t s = 0; s < slots.size(); s++)
+  {
+    bool alias = slots[s] >= assets.size();
+    size_t i = alias ? slots[s] - assets.size() : slots[s];
+    const Asset& a=assets[i];
+    const char *mimeType = WebServer::get_mime_type(a.url.c_str());
+
+    std::string mimeArg="NULL";
+    if (mimeType != NULL)
+      mimeArg=std::string("\"")+mimeType+"\"";
+
+    std::string fingerprintArg="NULL";
+    if (!alias && fingerprintedUrls.size())
+      fingerprintArg="\""+fingerprintedUrls[i]+"\"";
+
+    fprintf (f,"  { \"%s\", %lu, %s, %lu, %s, %lu, %s, \"\\\"%016llx\\\"\", %s, %s },\n",
+             urls[slots[s]].c_str(), (unsigned long)urls[slots[s]].size(), dataExprs[i].c_str(), (unsigned long)a.length,
+             gzipExprs[i].c_str(), (unsigned long)a.gzipLength, mimeArg.c_str(), a.hash,
+             fingerprintArg.c_str(), alias ? "true" : "false" );
+  }
+  fprintf (f, "};\n\n");
+  fprintf (f, "const size_t PrecompiledRepository::nbPages = %lu;\n\n", (unsigned long)slots.size());
+
+  fprintf (f, "const int PrecompiledRepository::hashDisplacements[] =\n{");
+  for (size_t b = 0; b < displacements.size(); b++)
+    fprintf (f, "%s%d%s", b % 16 ? " " : "\n  ", displacements[b], b + 1 < displacements.size() ? "," : "\n");
+  fprintf (f, "};\n");
+}
+
+/**********************************************************************/
+/**
+* add a string to the strings of the bundle
+* @return its offset in the bundle
+*/
+uint64_t bundle_string(std::string& strings, std::map<std::string, uint64_t>& offsets, uint64_t stringsOffset, const std::string& str)
+{
+  std::map<std::string, uint64_t>::const_iterator it = offsets.find(str);
+  if (it != offsets.end())
+    return it->second;
+
+  uint64_t offset = stringsOffset + strings.size();
+  strings += str;
+  strings += '\0';
+  offsets[str] = offset;
+  return offset;
+}
+
+inline uint64_t bundle_align(uint64_t offset)
+{
+  return (offset + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN * BUNDLE_ALIGN;
+}
+
+/**********************************************************************/
+/**
+* write the bundle file, loaded at runtime by BundleRepository
+*/
+void write_bundle()
+{
+  std::vector<std::string> urls, fingerprintedUrls;
+  std::vector<int> displacements;
+  std::vector<size_t> slots;
+  build_pages(urls, fingerprintedUrls, displacements, slots);
+
+  BundleHeader header;
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof header.magic);
+  header.version = BUNDLE_VERSION;
+  header.nbPages = slots.size();
+  header.pagesOffset = bundle_align(sizeof header);
+  header.displacementsOffset = header.pagesOffset + slots.size() * sizeof(BundlePage);
+  uint64_t stringsOffset = header.displacementsOffset + slots.size() * sizeof(int32_t);
+
+  std::string strings;
+  std::map<std::string, uint64_t> stringOffsets;
+  std::vector<BundlePage> pages(slots.size());
+  for (size_t s = 0; s < slots.size(); s++)
+  {
+    bool alias = slots[s] >= assets.size();
+    size_t i = alias ? slots[s] - assets.size() : slots[s];
+    const char *mimeType = WebServer::get_mime_type(assets[i].url.c_str());
+    char etag[32];
+    snprintf(etag, sizeof etag, "\"%016llx\"", assets[i].hash);
+
+    BundlePage& page = pages[s];
+    memset(&page, 0, sizeof page);
+    page.urlOffset = bundle_string(strings, stringOffsets, stringsOffset, urls[slots[s]]);
+    page.urlLength = urls[slots[s]].size();
+    page.length = assets[i].length;
+    page.gzipLength = assets[i].gzipLength;
+    page.mimeTypeOffset = mimeType != NULL ? bundle_string(strings, stringOffsets, stringsOffset, mimeType) : 0;
+    page.etagOffset = bundle_string(strings, stringOffsets, stringsOffset, etag);
+    if (!alias && fingerprintedUrls.size())
+      page.fingerprintedUrlOffset = bundle_string(strings, stringOffsets, stringsOffset, fingerprintedUrls[i]);
+    page.immutable = alias;
+  }
+
+  // the contents, once per content
+  std::map<std::string, std::pair<uint64_t, uint64_t> > contentOffsets;
+  uint64_t size = stringsOffset + strings.size();
+  for (size_t i = 0; i < assets.size(); i++)
+  {
+    std::string key = asset_key(assets[i]);
+    if (contentOffsets.count(key))
+      continue;
+    uint64_t dataOffset = size = bundle_align(size);
+    size += assets[i].length;
+    uint64_t gzipOffset = 0;
+    if (assets[i].gzipLength)
+    {
+      gzipOffset = size = bundle_align(size);
+      size += assets[i].gzipLength;
+    }
+    contentOffsets[key] = std::pair<uint64_t, uint64_t>(dataOffset, gzipOffset);
+  }
+  header.size = size;
+
+  for (size_t s = 0; s < slots.size(); s++)
+  {
+    size_t i = slots[s] >= assets.size() ? slots[s] - assets.size() : slots[s];
+    pages[s].dataOffset = contentOffsets[asset_key(assets[i])].first;
+    pages[s].gzipOffset = contentOffsets[asset_key(assets[i])].second;
+  }
+
+  std::vector<int32_t> bundleDisplacements(displacements.begin(), displacements.end());
+  static const char padding[BUNDLE_ALIGN] = { 0 };
+  FILE *f = open_output(bundlePath);
+  bool written = fwrite(&header, sizeof header, 1, f) == 1
+    && fwrite(padding, 1, header.pagesOffset - sizeof header, f) == header.pagesOffset - sizeof header
+    && fwrite(&pages[0], sizeof(BundlePage), pages.size(), f) == pages.size()
+    && fwrite(&bundleDisplacements[0], sizeof(int32_t), bundleDisplacements.size(), f) == bundleDisplacements.size()
+    && fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+
+  uint64_t offset = stringsOffset + strings.size();
+  std::set<std::string> writtenKeys;
+  for (size_t i = 0; written && i < assets.size(); i++)
+  {
+    Asset& a = assets[i];
+    std::string key = asset_key(a);
+    if (!writtenKeys.insert(key).second)
+    {
+      release_asset(a);
+      continue;
+    }
+
+    if (a.reused) load_asset(a);
+    const unsigned char *bufs[2] = { a.data, a.gzipData };
+    uint64_t offsets[2] = { contentOffsets[key].first, contentOffsets[key].second };
+    size_t lens[2] = { a.length, a.gzipLength };
+    for (int v = 0; written && v < (a.gzipLength ? 2 : 1); v++)
+    {
+      written = fwrite(padding, 1, offsets[v] - offset, f) == offsets[v] - offset
+        && fwrite(bufs[v], 1, lens[v], f) == lens[v];
+      offset = offsets[v] + lens[v];
+    }
+    release_asset(a);
+  }
+
+  if (!written)
+  {
+    fprintf(stderr, "ERROR: can't write the bundle '%s' !\n", bundlePath);
+    exit(EXIT_FAILURE);
+  }
+  close_output(f, bundlePath);
+}
+
 /**********************************************************************/
 /**
 * @brief  Main function
@@ -131,93 +987,188 @@ void parseDirectory( const std::string& dirPath )
 */ 
 int main (int argc, char *argv[])
 {
-  if (argc <= 1)
+  unsigned nbThreads=0, nbUnits=8;
+  int opt;
+  while ((opt = getopt(argc, argv, "nb:B:o:j:u:f:")) != -1)
+    switch (opt)
+    {
+      case 'n': precompress=false; break;
+      case 'b': blobPath=optarg; break;
+      case 'B': bundlePath=optarg; break;
+      case 'o': outDir=optarg; break;
+      case 'j': nbThreads=atoi(optarg); break;
+      case 'u': nbUnits=atoi(optarg); break;
+      case 'f': fingerprintManifest=optarg; break;
+      default: optind=argc+1;
+    }
+
+  if (optind >= argc || !nbUnits || (blobPath != NULL && bundlePath != NULL))
   {
-    printf("Usage: %s [dir ...]\n", argv[0]);
+    printf("Usage: %s [-n] [-b blobfile | -B bundlefile] [-o outdir [-u units]] [-j threads] [-f manifest.json] dir\n", argv[0]);
+    printf("   -n: don't generate the gzip variants\n");
+    printf("   -b: pack the assets in a binary file, linked with .incbin\n");
+    printf("       (path used by the assembler, relative to the compilation directory)\n");
+    printf("   -B: generate a bundle file, loaded at runtime by BundleRepository, instead of C++\n");
+    printf("   -o: generate precompiled_index.cc and the precompiled_<n>.cc data units in outdir\n");
+    printf("       (the manifest only, with -B), and only re-encode the files changed since the\n");
+    printf("       previous build\n");
+    printf("   -u: the number of data units (default: 8)\n");
+    printf("   -j: the number of encoding threads (default: the number of processors)\n");
+    printf("   -f: add the fingerprinted aliases of the urls (ex: js/app.3f9a1c07.js), served with\n");
+    printf("       an immutable Cache-Control, and write their lookup manifest (JSON)\n");
 //    printf("   ex: %s `find . -type f | cut -c 3-` > PrecompiledRepository.cc\n\n",  argv[0]);
     fflush(NULL);
     exit(EXIT_FAILURE);
   }
 
-  std::string directory=argv[1];
+  directory=argv[optind];
   while (directory.length() && directory[directory.length()-1] == '/')
     directory = directory.substr(0,directory.length()-1);
-  parseDirectory(directory); 
+  parseDirectory(directory);
   if (!filenamesVec.size())
   {
-    fprintf(stderr, "ERROR: The directory '%s' is empty or not found !\n", directory.c_str()); 
+    fprintf(stderr, "ERROR: The directory '%s' is empty or not found !\n", directory.c_str());
     exit(EXIT_FAILURE);
   }
 
-  ConversionEntry* conversionTable= (ConversionEntry*) malloc( filenamesVec.size() * sizeof(ConversionEntry));
-
-  fprintf (stdout, "#include \"libnavajo/PrecompiledRepository.hh\"\n\n");
-  fprintf (stdout, "namespace webRepository\n{\n");
+  if (!outDir.empty())
+  {
+    while (outDir.length() > 1 && outDir[outDir.length()-1] == '/')
+      outDir = outDir.substr(0,outDir.length()-1);
+    if ( (mkdir(outDir.c_str(), 0755) == -1 && errno != EEXIST)
+         || (mkdir((outDir + "/cache").c_str(), 0755) == -1 && errno != EEXIST) )
+    {
+      fprintf(stderr, "ERROR: can't create the directory '%s' !\n", outDir.c_str());
+      exit(EXIT_FAILURE);
+    }
+    load_manifest();
+  }
 
+  // encode the assets in parallel
+  filenamesSet.insert(filenamesVec.begin(), filenamesVec.end());
+  assets.resize(filenamesVec.size());
   for (size_t i = 0; i < filenamesVec.size(); i++)
   {
+    assets[i].filename = filenamesVec[i];
+    assets[i].data = assets[i].gzipData = NULL;
+    assets[i].reused = true;
+  }
 
-    FILE * pFile;
-    size_t lSize;
-    unsigned char * buffer;
-
-    std::string filename=directory + '/' + filenamesVec[i];
+  if (!nbThreads)
+  {
+    long nbCpu=sysconf(_SC_NPROCESSORS_ONLN);
+    nbThreads = nbCpu > 0 ? (unsigned)nbCpu : 1;
+  }
+  std::vector<pthread_t> threads(std::min((size_t)nbThreads, assets.size()) - 1);
+  for (size_t t = 0; t < threads.size(); t++)
+    create_thread( &threads[t], process_assets, NULL );
+  process_assets(NULL);
+  for (size_t t = 0; t < threads.size(); t++)
+    wait_for_thread( threads[t] );
 
-    pFile = fopen ( filename.c_str() , "rb" );
-    if (pFile==NULL)
-    { fprintf(stderr, "ERROR: can't read file: %s\n", filenamesVec[i].c_str()); exit (1); }
+  // output the variants, once per content
+  std::vector<std::string> dataExprs(assets.size()), gzipExprs(assets.size());
+  std::map<std::string, size_t> firstAsset;
+  std::set<std::string> keys;
+  for (size_t i = 0; i < assets.size(); i++)
+  {
+    std::string key = asset_key(assets[i]);
+    keys.insert(key);
+    firstAsset.insert(std::pair<std::string, size_t>(key, i));
+  }
 
-    // obtain file size.
-    fseek (pFile , 0 , SEEK_END);
-    lSize = ftell (pFile);
-    rewind (pFile);
+  if (bundlePath != NULL)
+    write_bundle();
+  else
+  {
+    FILE *out = stdout;
+    std::string indexPath = outDir + "/precompiled_index.cc";
+    if (!outDir.empty())
+      out = open_output(indexPath);
+    fprintf (out, "#include \"libnavajo/PrecompiledRepository.hh\"\n\n");
 
-    // allocate memory to contain the whole file.
-    buffer = (unsigned char*) malloc ((lSize+1)*sizeof(unsigned char));
-    if (buffer == NULL)
-      { fprintf(stderr, "ERROR: can't malloc reading file: %s\n", filenamesVec[i].c_str()); fclose(pFile); exit (2); }
+    if (blobPath != NULL)
+    {
+      FILE *blobFile = open_output(blobPath);
+      size_t blobSize = 0;
+      std::map<std::string, std::pair<size_t, size_t> > offsets;
+      for (size_t i = 0; i < assets.size(); i++)
+      {
+        Asset& a = assets[i];
+        std::string key = asset_key(a);
+        if (!offsets.count(key))
+        {
+          if (a.reused) load_asset(a);
+          size_t offset = write_blob(blobFile, &blobSize, a.data, a.length);
+          offsets[key] = std::pair<size_t, size_t>(offset, a.gzipLength ? write_blob(blobFile, &blobSize, a.gzipData, a.gzipLength) : 0);
+        }
+        release_asset(a);
 
-    // copy the file into the buffer.
-    if (fread (buffer,1,lSize,pFile) != lSize)
+        char expr[64];
+        snprintf(expr, sizeof expr, BLOB_SYMBOL " + %lu", (unsigned long)offsets[key].first);
+        dataExprs[i] = expr;
+        snprintf(expr, sizeof expr, BLOB_SYMBOL " + %lu", (unsigned long)offsets[key].second);
+        gzipExprs[i] = a.gzipLength ? expr : "NULL";
+      }
+      close_output(blobFile, blobPath);
+      emit_blob_stub(out, blobSize);
+    }
+    else
     {
-      fprintf(stderr,"\nCan't read file %s ... ABORT !\n", filenamesVec[i].c_str() );
-      fclose(pFile);
-      exit(1);
-    };
+      std::vector< std::vector<std::string> > units(nbUnits);
+      fprintf (out, "namespace webRepository\n{\n");
+      for (std::map<std::string, size_t>::const_iterator it = firstAsset.begin(); it != firstAsset.end(); it++)
+      {
+        const Asset& a = assets[it->second];
+        if (outDir.empty())
+          emit_arrays(out, a, false);
+        else
+        {
+          units[a.fileHash % nbUnits].push_back(it->first);
+          fprintf (out, "  extern const unsigned char %s[];\n", it->first.c_str());
+          if (a.gzipLength)
+            fprintf (out, "  extern const unsigned char %s_gz[];\n", it->first.c_str());
+        }
+      }
+      fprintf (out, "}\n\n");
 
-    std::string outFilename = filenamesVec[i];
-    std::replace( outFilename.begin(), outFilename.end(), '.', '_'); 
-    std::replace( outFilename.begin(), outFilename.end(), '/', '_'); 
-    std::replace( outFilename.begin(), outFilename.end(), ' ', '_'); 
-    std::replace( outFilename.begin(), outFilename.end(), '-', '_'); 
+      for (size_t i = 0; i < assets.size(); i++)
+      {
+        std::string key = asset_key(assets[i]);
+        release_asset(assets[i]);
+        dataExprs[i] = "webRepository::" + key;
+        gzipExprs[i] = assets[i].gzipLength ? "webRepository::" + key + "_gz" : "NULL";
+      }
 
-    fprintf (stdout, "  static const unsigned char %s[] =\n", outFilename.c_str());
-    fprintf (stdout, "  {\n" );
-    dump_buffer(stdout,lSize, const_cast<unsigned char*>(buffer));
-    fprintf (stdout, "\n  };\n\n");
-    fclose (pFile);
-    free (buffer);
+      // the data units include the cached arrays
+      for (unsigned u = 0; u < nbUnits && !outDir.empty(); u++)
+      {
+        char unitName[32];
+        snprintf(unitName, sizeof unitName, "/precompiled_%u.cc", u);
+        FILE *f = open_output(outDir + unitName);
+        fprintf (f, "namespace webRepository\n{\n");
+        for (size_t k = 0; k < units[u].size(); k++)
+          fprintf (f, "#include \"cache/%s.inc\"\n", units[u][k].c_str());
+        fprintf (f, "}\n");
+        close_output(f, outDir + unitName);
+      }
+    }
 
-    (*(conversionTable+i)).URL = new std::string(filenamesVec[i]);
-    (*(conversionTable+i)).varName = new std::string(outFilename);
-    (*(conversionTable+i)).length = lSize;
+    emit_index(out, dataExprs, gzipExprs);
+    if (!outDir.empty())
+      close_output(out, indexPath);
   }
-  
-  fprintf (stdout, "}\n\n");
-  
-  fprintf (stdout, "PrecompiledRepository::IndexMap PrecompiledRepository::indexMap;\n");
-  fprintf (stdout, "std::string PrecompiledRepository::location;\n");
-  fprintf (stdout,"\nvoid PrecompiledRepository::initIndexMap()\n{\n");
 
-  for (size_t i = 0; i < filenamesVec.size(); i++)
+  if (!outDir.empty())
   {
-    fprintf (stdout,"    indexMap.insert(IndexMap::value_type(\"%s\",PrecompiledRepository::WebStaticPage((const unsigned char*)&webRepository::%s, sizeof webRepository::%s)));\n", (*(conversionTable+i)).URL->c_str(), (*(conversionTable+i)).varName->c_str(), (*(conversionTable+i)).varName->c_str() );
-    delete (*(conversionTable+i)).URL;
-    delete (*(conversionTable+i)).varName;
+    save_manifest();
+    clean_cache(keys);
+
+    size_t nbEncoded = 0;
+    for (size_t i = 0; i < assets.size(); i++)
+      if (!assets[i].reused) nbEncoded++;
+    fprintf(stderr, "navajoPrecompiler: %lu files, %lu encoded\n", (unsigned long)assets.size(), (unsigned long)nbEncoded);
   }
-  fprintf (stdout,"}\n");
-  free (conversionTable);
 
   return (EXIT_SUCCESS);
 }
-